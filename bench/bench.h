@@ -0,0 +1,19 @@
+/*
+ * bench.h — helpers shared by the benchmarks, included right after
+ * ../mouse_move.c
+ */
+
+#ifndef MOUSE_MOVE_BENCH_H
+#define MOUSE_MOVE_BENCH_H
+
+// first key bound to action on the base layer of the loaded config, -1 if none
+static int key_for_action(Action action) {
+	for(int code = 0; code < KEY_CNT; code++) {
+		if(config->keymap[0][code] == action) {
+			return code;
+		}
+	}
+	return -1;
+}
+
+#endif /* MOUSE_MOVE_BENCH_H */
@@ -0,0 +1,467 @@
+/*
+ * e2e_bench.c — kernel loopback benchmark for mouse_move
+ *
+ * Measures the whole path, evdev -> mouse_move -> /dev/uinput -> evdev:
+ * a uinput keyboard is created, the daemon is started on it alone (-d)
+ * with the config.h defaults (-c /dev/null), and its "virtual mouse" is
+ * read back through evdev. Scripted rounds of start combo, held motion key,
+ * click, scroll and exit combo report key -> event latency on the kernel
+ * timestamps, the achieved px/s against the configured speed, and grab
+ * activation, read from the daemon's shared state block.
+ *
+ * Needs /dev/uinput and /dev/input access (root, or the udev rules from
+ * README.md), no physical device and no display. Build and run with:
+ *      make e2e-bench
+ */
+
+#define main mouse_move_main
+#include "../mouse_move.c"
+#undef main
+#include "bench.h"
+
+#include <poll.h>
+#include <sys/wait.h>
+
+#define MOUSE_NAME "virtual mouse"
+#define MAX_MICE 8
+#define START_TIMEOUT_MS 3000
+#define EVENT_TIMEOUT_MS 1000
+#define HOLD_MS 1000
+
+static Histogram key_to_motion;
+static Histogram key_to_click;
+static Histogram key_to_scroll;
+static Histogram grab_activation;
+
+static struct libevdev_uinput* keyboard;
+static int mouse_fd = -1;
+static const struct mouse_move_state* state;
+static bool verbose;
+
+static void sleep_ms(int ms) {
+	struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+	nanosleep(&ts, NULL);
+}
+
+// one key change as its own packet, returns the time right before it was sent
+static uint64_t send_key(int code, int value) {
+	uint64_t t = now_ns();
+	libevdev_uinput_write_event(keyboard, EV_KEY, code, value);
+	libevdev_uinput_write_event(keyboard, EV_SYN, SYN_REPORT, 0);
+	return t;
+}
+
+static uint64_t send_combo(const Combo* combo) {
+	for(size_t i = 0; i < combo->size; i++) {
+		send_key(combo->keys[i], 1);
+	}
+	sleep_ms(50);
+	uint64_t t = 0;
+	for(size_t i = 0; i < combo->size; i++) {
+		t = send_key(combo->keys[i], 0);
+	}
+	return t;
+}
+
+/*
+ * Only the keys the config uses, and no autorepeat (EV_REP): a daemon
+ * already running with auto-detection must not take this keyboard, it
+ * would fight ours for the grab and obey the kill combo.
+ */
+static struct libevdev_uinput* create_keyboard(void) {
+	struct libevdev* dev = libevdev_new();
+	struct libevdev_uinput* uidev = NULL;
+	const Combo* combos[] = { &config->start_combo, &config->exit_combo, &config->kill_combo };
+
+	libevdev_set_name(dev, "mouse_move e2e keyboard");
+	libevdev_enable_event_type(dev, EV_KEY);
+	for(int code = 0; code < KEY_CNT; code++) {
+		if(test_bit(config->bound_keys, code)) {
+			libevdev_enable_event_code(dev, EV_KEY, code, NULL);
+		}
+	}
+	for(size_t i = 0; i < sizeof(combos) / sizeof(combos[0]); i++) {
+		for(size_t j = 0; j < combos[i]->size; j++) {
+			libevdev_enable_event_code(dev, EV_KEY, combos[i]->keys[j], NULL);
+		}
+	}
+	int err = libevdev_uinput_create_from_device(dev, LIBEVDEV_UINPUT_OPEN_MANAGED, &uidev);
+	libevdev_free(dev);
+	if(err != 0) {
+		errno = -err;
+		perror("Failed to create the uinput keyboard");
+		return NULL;
+	}
+	return uidev;
+}
+
+// event node names of every device called MOUSE_NAME
+static size_t find_mice(char names[][NAME_MAX + 1]) {
+	size_t n = 0;
+	char name[128];
+	DIR* dir = opendir(SYSFS_INPUT_DIR);
+	if(dir == NULL) {
+		return 0;
+	}
+	struct dirent* entry;
+	while((entry = readdir(dir)) != NULL && n < MAX_MICE) {
+		if(strncmp(entry->d_name, "event", 5) == 0
+			&& read_sysfs_line(entry->d_name, "name", name, sizeof(name)) == 0
+			&& strcmp(name, MOUSE_NAME) == 0) {
+			snprintf(names[n++], NAME_MAX + 1, "%s", entry->d_name);
+		}
+	}
+	closedir(dir);
+	return n;
+}
+
+// the virtual mouse of our daemon: the one that wasn't there before it started
+static int open_new_mouse(char before[][NAME_MAX + 1], size_t n_before) {
+	char after[MAX_MICE][NAME_MAX + 1];
+	char path[MAX_DEVICE_PATH_SIZE];
+	for(int waited = 0; waited < START_TIMEOUT_MS; waited += 10) {
+		size_t n_after = find_mice(after);
+		for(size_t i = 0; i < n_after; i++) {
+			bool seen = false;
+			for(size_t j = 0; j < n_before; j++) {
+				seen |= strcmp(after[i], before[j]) == 0;
+			}
+			if(seen || snprintf(path, sizeof(path), INPUT_DIR "/%s", after[i]) >= (int) sizeof(path)) {
+				continue;
+			}
+			int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+			if(fd < 0) {
+				// udev may not have fixed its permissions yet
+				continue;
+			}
+			int clock_id = CLOCK_MONOTONIC;
+			ioctl(fd, EVIOCSCLOCKID, &clock_id);
+			return fd;
+		}
+		sleep_ms(10);
+	}
+	fprintf(stderr, "The daemon's " MOUSE_NAME " did not show up\n");
+	return -1;
+}
+
+static pid_t start_daemon(const char* daemon, const char* keyboard_path) {
+	pid_t pid = fork();
+	if(pid != 0) {
+		return pid;
+	}
+	if(!verbose) {
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDERR_FILENO);
+	}
+	execl(daemon, daemon, "-c", "/dev/null", "-d", keyboard_path, (char*) NULL);
+	perror(daemon);
+	_exit(127);
+}
+
+/*
+ * Ask the daemon for its state block over the control socket, see
+ * mouse_move_state.h. Grab activation is only measured with it.
+ */
+static const struct mouse_move_state* map_state(void) {
+	char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fds[2] = { -1, -1 };
+	char reply[64];
+
+	control_socket_path(path, sizeof(path));
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(path[0] == '\0' || fd < 0) {
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+	int err = -1;
+	for(int waited = 0; waited < START_TIMEOUT_MS && err < 0; waited += 10) {
+		err = connect(fd, (struct sockaddr*) &addr, sizeof(addr));
+		if(err < 0) {
+			sleep_ms(10);
+		}
+	}
+	union {
+		char buff[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {
+		.iov_base = reply,
+		.iov_len = sizeof(reply),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buff,
+		.msg_controllen = sizeof(control.buff),
+	};
+	if(err < 0 || write(fd, "state_fd\n", 9) != 9 || recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if(cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+		return NULL;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	close(fds[1]);
+	void* block = mmap(NULL, sizeof(struct mouse_move_state), PROT_READ, MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	return block == MAP_FAILED ? NULL : block;
+}
+
+// wait for the daemon's mode; the grab time comes from the block, so polling is fine
+static bool wait_mode(uint32_t mode, struct mouse_move_state* s) {
+	for(int waited = 0; waited < EVENT_TIMEOUT_MS; waited++) {
+		mouse_move_state_read(state, s);
+		if(s->mode == mode) {
+			return true;
+		}
+		sleep_ms(1);
+	}
+	return false;
+}
+
+// next event of the virtual mouse, false after timeout_ms without one
+static bool next_event(struct input_event* ev, int timeout_ms) {
+	while(read(mouse_fd, ev, sizeof(*ev)) != sizeof(*ev)) {
+		struct pollfd p = { .fd = mouse_fd, .events = POLLIN };
+		if(poll(&p, 1, timeout_ms) <= 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void drain_events(void) {
+	struct input_event ev;
+	while(next_event(&ev, 0)) {
+	}
+}
+
+// wait for type/code, any value unless want_value >= 0; returns its timestamp or 0
+static uint64_t wait_event(uint16_t type, uint16_t code, int want_value) {
+	struct input_event ev;
+	while(next_event(&ev, EVENT_TIMEOUT_MS)) {
+		if(ev.type == type && ev.code == code && (want_value < 0 || ev.value == want_value)) {
+			return event_time_ns(&ev);
+		}
+	}
+	return 0;
+}
+
+static void add_latency(Histogram* h, const char* what, uint64_t sent, uint64_t seen) {
+	if(seen == 0) {
+		fprintf(stderr, "No %s within %d ms\n", what, EVENT_TIMEOUT_MS);
+		return;
+	}
+	hist_add(h, seen - MIN(seen, sent));
+}
+
+/*
+ * Hold the motion key for HOLD_MS: latency to the first REL_X, and the
+ * speed from the first to the last REL_X, which leaves the reaction time
+ * out. Adds to the pixels and time of all rounds.
+ */
+static void bench_motion(int key, long* pixels, uint64_t* moving_ns) {
+	struct input_event ev;
+	uint64_t first = 0, last = 0;
+	long sum = 0;
+
+	drain_events();
+	uint64_t sent = send_key(key, 1);
+	uint64_t deadline = sent + HOLD_MS * 1000000ULL;
+	while(now_ns() < deadline && next_event(&ev, HOLD_MS)) {
+		if(ev.type != EV_REL || ev.code != REL_X) {
+			continue;
+		}
+		if(first == 0) {
+			first = event_time_ns(&ev);
+		}
+		else {
+			sum += ev.value;
+			last = event_time_ns(&ev);
+		}
+	}
+	send_key(key, 0);
+	add_latency(&key_to_motion, "REL_X", sent, first);
+	if(last > first) {
+		*pixels += sum;
+		*moving_ns += last - first;
+	}
+}
+
+static void bench_click(int key) {
+	drain_events();
+	uint64_t sent = send_key(key, 1);
+	add_latency(&key_to_click, "BTN_LEFT press", sent, wait_event(EV_KEY, BTN_LEFT, 1));
+	sleep_ms(config->click_delay_ms + 20);
+	send_key(key, 0);
+	wait_event(EV_KEY, BTN_LEFT, 0);
+	sleep_ms(config->click_delay_ms + 20);
+}
+
+static void bench_scroll(int key) {
+	uint16_t code = config->scroll_hi_res ? REL_WHEEL_HI_RES : REL_WHEEL;
+	drain_events();
+	uint64_t sent = send_key(key, 1);
+	add_latency(&key_to_scroll, "wheel event", sent, wait_event(EV_REL, code, -1));
+	send_key(key, 0);
+	// let kinetic scrolling run out
+	sleep_ms(config->scroll_kinetic_ms * 4 + 50);
+}
+
+// start combo, then wait for the grab; adds to grab_activation
+static bool enter_mouse_mode(void) {
+	struct mouse_move_state s;
+	uint64_t released = send_combo(&config->start_combo);
+	if(state == NULL) {
+		sleep_ms(100);
+		return true;
+	}
+	if(!wait_mode(MOUSE_MOVE_MODE_GRABBING, &s)) {
+		fprintf(stderr, "The start combo did not grab\n");
+		return false;
+	}
+	hist_add(&grab_activation, s.grab_start_ns - MIN(s.grab_start_ns, released));
+	return true;
+}
+
+static int run_rounds(int rounds) {
+	int right = key_for_action(ACTION_RIGHT);
+	int click = key_for_action(ACTION_BUTTON_LEFT);
+	int scroll = key_for_action(ACTION_SCROLL_DOWN);
+	struct mouse_move_state s;
+	long pixels = 0;
+	uint64_t moving_ns = 0;
+
+	if(right < 0 || click < 0 || scroll < 0) {
+		fprintf(stderr, "The benchmark needs right, button_left and scroll_down bound\n");
+		return 1;
+	}
+	for(int i = 0; i < rounds; i++) {
+		if(!enter_mouse_mode()) {
+			return 1;
+		}
+		bench_motion(right, &pixels, &moving_ns);
+		bench_click(click);
+		bench_scroll(scroll);
+		send_combo(&config->exit_combo);
+		if(state != NULL) {
+			wait_mode(MOUSE_MOVE_MODE_IDLE, &s);
+		}
+		else {
+			sleep_ms(100);
+		}
+	}
+
+	printf("rounds:  %d of start combo, %d ms motion, click, scroll, exit combo\n", rounds, HOLD_MS);
+	if(moving_ns > 0) {
+		double speed = pixels / (moving_ns / 1e9);
+		printf("motion:  %ld px in %.3f s = %.1f px/s (speed %d, %.1f%%)\n",
+			pixels, moving_ns / 1e9, speed, config->motion_speeds[TIER_NORMAL],
+			100.0 * speed / config->motion_speeds[TIER_NORMAL]);
+	}
+	printf("latency:");
+	print_histogram(stdout, "key_to_motion", &key_to_motion);
+	print_histogram(stdout, "key_to_click", &key_to_click);
+	print_histogram(stdout, "key_to_scroll", &key_to_scroll);
+	if(state != NULL) {
+		print_histogram(stdout, "grab_activation", &grab_activation);
+	}
+	printf("\n");
+	if(state == NULL) {
+		printf("no state block from the daemon, grab activation not measured\n");
+	}
+	return 0;
+}
+
+static void e2e_usage(const char* name) {
+	fprintf(stderr, "usage: %s [-v] [-n rounds] [-m mouse_move]\n", name);
+	fprintf(stderr, "  -v  show the daemon's stderr\n");
+	fprintf(stderr, "  -n  rounds of the scripted session (default 10)\n");
+	fprintf(stderr, "  -m  daemon binary to start (default ./mouse_move)\n");
+}
+
+int main(int argc, char** argv) {
+	const char* daemon = "./mouse_move";
+	char runtime_dir[] = "/tmp/mm_e2e.XXXXXX";
+	char before[MAX_MICE][NAME_MAX + 1];
+	int rounds = 10;
+	int opt;
+
+	while((opt = getopt(argc, argv, "vn:m:h")) != -1) {
+		switch(opt) {
+		case 'v':
+			verbose = true;
+			break;
+		case 'n':
+			rounds = atoi(optarg);
+			break;
+		case 'm':
+			daemon = optarg;
+			break;
+		default:
+			e2e_usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if(rounds < 1) {
+		e2e_usage(argv[0]);
+		return 1;
+	}
+
+	// the same defaults the daemon gets with -c /dev/null
+	config = load_config(config_path);
+	if(config == NULL) {
+		return 1;
+	}
+	// a control socket of its own, next to a daemon that may already run
+	if(mkdtemp(runtime_dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	setenv("XDG_RUNTIME_DIR", runtime_dir, 1);
+
+	keyboard = create_keyboard();
+	if(keyboard == NULL) {
+		rmdir(runtime_dir);
+		return 1;
+	}
+	size_t n_before = find_mice(before);
+	pid_t pid = start_daemon(daemon, libevdev_uinput_get_devnode(keyboard));
+	int ret = 1;
+	if(pid > 0) {
+		mouse_fd = open_new_mouse(before, n_before);
+	}
+	if(mouse_fd >= 0) {
+		state = map_state();
+		// the loop starts right after the virtual devices exist
+		sleep_ms(100);
+		ret = run_rounds(rounds);
+		// the kill combo only counts in mouse mode
+		if(enter_mouse_mode()) {
+			send_combo(&config->kill_combo);
+		}
+	}
+
+	if(pid > 0) {
+		int status;
+		for(int waited = 0; waitpid(pid, &status, WNOHANG) == 0; waited += 10) {
+			if(waited == START_TIMEOUT_MS) {
+				kill(pid, SIGTERM);
+			}
+			if(waited == 2 * START_TIMEOUT_MS) {
+				kill(pid, SIGKILL);
+			}
+			sleep_ms(10);
+		}
+	}
+	if(mouse_fd >= 0) {
+		close(mouse_fd);
+	}
+	libevdev_uinput_destroy(keyboard);
+	rmdir(runtime_dir);
+	return ret;
+}
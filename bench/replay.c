@@ -0,0 +1,356 @@
+/*
+ * replay.c — deterministic record/replay harness for mouse_move
+ *
+ * Feeds a recording made with `mouse_move -r file`, or a built-in scripted
+ * session when no file is given, through the daemon's own process_events
+ * and handle_mouse. The clock is taken from the recorded timestamps and the
+ * uinput device is replaced by an in-memory sink, so no keyboard, no
+ * /dev/uinput and no root are needed.
+ *
+ * Reports the emitted REL/KEY/SYN stream (-v), per-event processing time
+ * and total throughput. Build and run with:
+ *      make replay-bench [REPLAY=file]
+ */
+
+#define MOUSE_MOVE_REPLAY
+#define main mouse_move_main
+#include "../mouse_move.c"
+#undef main
+#include "bench.h"
+
+#include <math.h>
+
+#define MAX_CAPTURE 65536
+
+typedef struct {
+	uint64_t time_ns;
+	struct input_event event;
+} Emitted;
+
+static Emitted capture[MAX_CAPTURE];
+static size_t capture_count;
+static bool capturing;
+static uint64_t replay_now;
+
+static void replay_sink(const struct input_event* events, size_t count) {
+	if(!capturing) {
+		return;
+	}
+	for(size_t i = 0; i < count && capture_count < MAX_CAPTURE; i++) {
+		capture[capture_count].time_ns = replay_now;
+		capture[capture_count].event = events[i];
+		capture_count++;
+	}
+}
+
+static Record* records;
+static size_t records_count;
+static size_t records_size;
+
+static void script_event(uint64_t t, uint16_t type, uint16_t code, int32_t value) {
+	if(records_count == records_size) {
+		records_size = records_size ? records_size * 2 : 1024;
+		records = realloc(records, records_size * sizeof(Record));
+		if(records == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	records[records_count++] = (Record){ .time_ns = t, .type = type, .code = code, .value = value };
+}
+
+// one kernel packet: scancode, key, SYN_REPORT
+static void script_key(uint64_t t, int code, int value) {
+	script_event(t, EV_MSC, MSC_SCAN, code);
+	script_event(t, EV_KEY, code, value);
+	script_event(t, EV_SYN, SYN_REPORT, 0);
+}
+
+// press keys at t, autorepeat the last one like the kernel does, release at t + hold
+static uint64_t script_hold(uint64_t t, const int* keys, size_t n, uint64_t hold_ms) {
+	for(size_t i = 0; i < n; i++) {
+		script_key(t, keys[i], 1);
+	}
+	for(uint64_t r = 250; r < hold_ms; r += 33) {
+		script_key(t + r * 1000000ULL, keys[n - 1], 2);
+	}
+	t += hold_ms * 1000000ULL;
+	for(size_t i = 0; i < n; i++) {
+		script_key(t, keys[i], 0);
+	}
+	return t + 200 * 1000000ULL;
+}
+
+// start combo, straight and diagonal motion, a click, a scroll, exit combo
+static int script_session(void) {
+	const int right[] = { key_for_action(ACTION_RIGHT) };
+	const int diagonal[] = { key_for_action(ACTION_DOWN), key_for_action(ACTION_RIGHT) };
+	const int click[] = { key_for_action(ACTION_BUTTON_LEFT) };
+	const int scroll[] = { key_for_action(ACTION_SCROLL_DOWN) };
+	uint64_t t = 1000000000ULL;
+
+	if(right[0] < 0 || diagonal[0] < 0 || click[0] < 0 || scroll[0] < 0) {
+		fprintf(stderr, "The scripted session needs right, down, button_left and scroll_down bound\n");
+		return 1;
+	}
+
+	t = script_hold(t, config->start_combo.keys, config->start_combo.size, 80);
+	t = script_hold(t, right, 1, 2000);
+	t = script_hold(t, diagonal, 2, 1000);
+	t = script_hold(t, click, 1, 100);
+	t = script_hold(t, scroll, 1, 1000);
+	script_hold(t, config->exit_combo.keys, config->exit_combo.size, 80);
+	return 0;
+}
+
+static int load_recording(const char* path) {
+	char magic[8];
+	Record r;
+
+	FILE* f = fopen(path, "re");
+	if(f == NULL) {
+		perror(path);
+		return 1;
+	}
+	if(fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, RECORD_MAGIC, sizeof(magic)) != 0) {
+		fprintf(stderr, "%s is not a mouse_move recording\n", path);
+		fclose(f);
+		return 1;
+	}
+	while(fread(&r, sizeof(r), 1, f) == 1) {
+		script_event(r.time_ns, r.type, r.code, r.value);
+	}
+	fclose(f);
+	return 0;
+}
+
+typedef struct {
+	uint64_t* event_ns; // processing time of each input packet
+	size_t event_count;
+	uint64_t tick_ns;
+	size_t tick_count;
+	uint64_t moving_ns; // injected time spent with a motion key held
+} Timing;
+
+static uint64_t wall_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// run every tick that falls due before t, as the timerfd would
+static void run_ticks_until(Mouse* m, uint64_t t, bool grabbing, Timing* timing) {
+	uint64_t deadline;
+	while(grabbing && (deadline = next_deadline(m)) != 0 && deadline <= t) {
+		if(motion_keys_held(m)) {
+			timing->moving_ns += deadline - replay_now;
+		}
+		replay_now = deadline;
+		uint64_t start = wall_ns();
+		handle_mouse(m, deadline);
+		timing->tick_ns += wall_ns() - start;
+		timing->tick_count++;
+	}
+	if(grabbing && motion_keys_held(m)) {
+		timing->moving_ns += t - replay_now;
+	}
+	replay_now = t;
+}
+
+static int replay_once(Timing* timing) {
+	Keyboards keyboards;
+	Mouse mouse;
+	Mode mode = MODE_IDLE;
+	bool quit = false;
+
+	for(int i = 0; i < MAX_KEYBOARDS; i++) {
+		keyboards.devices[i].fd = -1;
+	}
+	// never read, only marks the slot as in use
+	keyboards.devices[0].fd = 0;
+	memset(keyboards.devices[0].keys, 0, sizeof(keyboards.devices[0].keys));
+	keyboards.devices[0].dropped = false;
+	keyboards.lost_count = 0;
+
+	if(init_mouse_state(&mouse) != 0) {
+		return 1;
+	}
+	replay_now = records_count ? records[0].time_ns : 0;
+
+	// events sharing a timestamp came from one read, process them as a batch
+	struct input_event batch[EVENT_BUFFER_SIZE];
+	size_t i = 0;
+	while(i < records_count && !quit) {
+		uint64_t t = records[i].time_ns;
+		size_t n = 0;
+		while(i < records_count && records[i].time_ns == t && n < EVENT_BUFFER_SIZE) {
+			batch[n] = (struct input_event){ .type = records[i].type, .code = records[i].code, .value = records[i].value };
+			batch[n].input_event_sec = t / 1000000000ULL;
+			batch[n].input_event_usec = t % 1000000000ULL / 1000;
+			n++;
+			i++;
+		}
+		run_ticks_until(&mouse, t, mode == MODE_GRABBING, timing);
+
+		uint64_t start = wall_ns();
+		process_events(batch, n, &keyboards.devices[0], &keyboards, &mouse, &mode, &quit);
+		if(mode == MODE_GRABBING) {
+			handle_mouse(&mouse, t);
+		}
+		timing->event_ns[timing->event_count++] = wall_ns() - start;
+	}
+	run_ticks_until(&mouse, replay_now + MOTION_MAX_DT_NS, mode == MODE_GRABBING, timing);
+	return 0;
+}
+
+static int compare_u64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+	return (x > y) - (x < y);
+}
+
+static void print_stream(void) {
+	uint64_t t0 = records_count ? records[0].time_ns : 0;
+	for(size_t i = 0; i < capture_count; i++) {
+		struct input_event* ev = &capture[i].event;
+		const char* type = libevdev_event_type_get_name(ev->type);
+		const char* code = libevdev_event_code_get_name(ev->type, ev->code);
+		printf("%12.3f ms  %-6s %-12s %d\n", (capture[i].time_ns - t0) / 1e6, type ? type : "?", code ? code : "?", ev->value);
+	}
+}
+
+static void print_summary(Timing* timing, int iterations) {
+	long rel_x = 0, rel_y = 0, wheel = 0, hwheel = 0, wheel_hi_res = 0, hwheel_hi_res = 0;
+	size_t presses = 0, releases = 0, syns = 0;
+	double distance = 0;
+
+	for(size_t i = 0; i < capture_count; i++) {
+		struct input_event* ev = &capture[i].event;
+		if(ev->type == EV_REL && ev->code == REL_X) rel_x += ev->value;
+		if(ev->type == EV_REL && ev->code == REL_Y) rel_y += ev->value;
+		if(ev->type == EV_REL && ev->code == REL_WHEEL) wheel += ev->value;
+		if(ev->type == EV_REL && ev->code == REL_HWHEEL) hwheel += ev->value;
+		if(ev->type == EV_REL && ev->code == REL_WHEEL_HI_RES) wheel_hi_res += ev->value;
+		if(ev->type == EV_REL && ev->code == REL_HWHEEL_HI_RES) hwheel_hi_res += ev->value;
+		if(ev->type == EV_KEY && ev->value) presses++;
+		if(ev->type == EV_KEY && !ev->value) releases++;
+		if(ev->type == EV_SYN) syns++;
+	}
+	// euclidean length of the path, frame by frame
+	int fx = 0, fy = 0;
+	for(size_t i = 0; i < capture_count; i++) {
+		struct input_event* ev = &capture[i].event;
+		if(ev->type == EV_REL && ev->code == REL_X) fx = ev->value;
+		if(ev->type == EV_REL && ev->code == REL_Y) fy = ev->value;
+		if(ev->type == EV_SYN) {
+			distance += sqrt((double) fx * fx + (double) fy * fy);
+			fx = fy = 0;
+		}
+	}
+
+	printf("input:   %zu events in %zu packets\n", records_count, timing->event_count / iterations);
+	printf("output:  %zu frames (SYN_REPORT), REL_X %+ld, REL_Y %+ld, REL_WHEEL %+ld (hi-res %+ld), REL_HWHEEL %+ld (hi-res %+ld), buttons %zu down / %zu up\n",
+		syns, rel_x, rel_y, wheel, wheel_hi_res, hwheel, hwheel_hi_res, presses, releases);
+	if(timing->moving_ns > 0) {
+		printf("motion:  %.0f px in %.3f s held = %.1f px/s (speed %d)\n",
+			distance, timing->moving_ns / 1e9 / iterations, distance / (timing->moving_ns / 1e9 / iterations), config->motion_speeds[TIER_NORMAL]);
+	}
+
+	// latency on the recorded clock: what the processing logic adds, not the kernel
+	printf("latency:");
+	print_histogram(stdout, "key_to_click", &latency.key_to_click);
+	print_histogram(stdout, "key_to_motion", &latency.key_to_motion);
+	print_histogram(stdout, "tick_jitter", &latency.tick_jitter);
+	printf("\n");
+
+	uint64_t total = 0;
+	for(size_t i = 0; i < timing->event_count; i++) {
+		total += timing->event_ns[i];
+	}
+	qsort(timing->event_ns, timing->event_count, sizeof(uint64_t), compare_u64);
+	printf("packets: %zu processed, mean %.0f ns, p50 %llu ns, p99 %llu ns, max %llu ns\n",
+		timing->event_count, timing->event_count ? (double) total / timing->event_count : 0.0,
+		(unsigned long long) timing->event_ns[timing->event_count / 2],
+		(unsigned long long) timing->event_ns[timing->event_count * 99 / 100],
+		(unsigned long long) timing->event_ns[timing->event_count - 1]);
+	printf("ticks:   %zu run, mean %.0f ns\n",
+		timing->tick_count, timing->tick_count ? (double) timing->tick_ns / timing->tick_count : 0.0);
+	printf("total:   %.2f ms for %d iterations, %.0f input events/s\n",
+		(total + timing->tick_ns) / 1e6, iterations,
+		(double) records_count * iterations / ((total + timing->tick_ns) / 1e9));
+}
+
+static void replay_usage(const char* name) {
+	fprintf(stderr, "usage: %s [-v] [-n iterations] [-c config] [recording]\n", name);
+	fprintf(stderr, "  -v  print the emitted event stream\n");
+	fprintf(stderr, "  -n  replay the input this many times for timing (default 1)\n");
+	fprintf(stderr, "  -c  config file (default: the built-in config.h defaults)\n");
+	fprintf(stderr, "without a recording a scripted session is replayed\n");
+}
+
+int main(int argc, char** argv) {
+	bool verbose = false;
+	int iterations = 1;
+	int opt;
+
+	while((opt = getopt(argc, argv, "vn:c:h")) != -1) {
+		switch(opt) {
+		case 'c':
+			snprintf(config_path, sizeof(config_path), "%s", optarg);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		default:
+			replay_usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if(iterations < 1) {
+		replay_usage(argv[0]);
+		return 1;
+	}
+
+	config = load_config(config_path);
+	if(config == NULL) {
+		return 1;
+	}
+
+	if(optind < argc) {
+		if(load_recording(argv[optind]) != 0) {
+			return 1;
+		}
+	}
+	else if(script_session() != 0) {
+		return 1;
+	}
+	if(records_count == 0) {
+		fprintf(stderr, "Nothing to replay\n");
+		return 1;
+	}
+
+	Timing timing = {0};
+	timing.event_ns = calloc(records_count * (size_t) iterations, sizeof(uint64_t));
+	if(timing.event_ns == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	for(int i = 0; i < iterations; i++) {
+		// only the first run is captured, the others are for timing
+		capturing = (i == 0);
+		if(replay_once(&timing) != 0) {
+			return 1;
+		}
+	}
+
+	if(verbose) {
+		print_stream();
+	}
+	print_summary(&timing, iterations);
+	free(timing.event_ns);
+	free(records);
+	return 0;
+}
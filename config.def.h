@@ -80,7 +80,8 @@
  *      • cat /proc/bus/input/devices
  *        Look for entries with EV=120013 or similar.
  *
- *  Leaving KEYBOARD_DEVICE as "" enables auto-detection (not always reliable).
+ *  Leaving KEYBOARD_DEVICE as "" enables auto-detection: every keyboard found is
+ *  used, and keyboards plugged in later are picked up without a restart.
  *
  * ─────────────────────────────────────────────────────────────────────────────
  *  KEYBOARD LAYOUT:
@@ -100,12 +101,41 @@
  * DEVICE SETTINGS
  ******************************************************************************/
 
-/* Path to keyboard device — set manually or leave "" for auto-detect */
+/* Path to keyboard device — set manually or leave "" to use all keyboards */
 #define KEYBOARD_DEVICE ""
 
-/* Maximum number of input devices to scan during auto-detect */
+/* Maximum number of input devices considered during auto-detect */
 #define MAX_DEVICES 64
 
+/*
+ * A keyboard that goes away (unplug, USB reset, suspend) ends mouse mode
+ * and is waited for: when the same device shows up again within this time
+ * it is reattached and the time it took is logged. It is matched by its
+ * vendor, product and name, so a changed event number doesn't matter.
+ */
+#define RECONNECT_TIMEOUT_MS 10000
+
+
+/******************************************************************************
+ * RUNTIME CONFIG FILE
+ ******************************************************************************/
+
+/*
+ * Everything below is only the default. A config file, read at startup and
+ * reloaded whenever it changes, can override bindings, speeds and delays
+ * without a rebuild. Its path is CONFIG_FILE, or -c file, or if both are
+ * empty $XDG_CONFIG_HOME/mouse_move/config (~/.config/mouse_move/config).
+ * A missing file is fine. See README.md for the format.
+ */
+#define CONFIG_FILE ""
+
+/*
+ * Control socket for scripts: grab/ungrab, speed tier, live config changes,
+ * state and stats, one command per line. "" puts it at
+ * $XDG_RUNTIME_DIR/mouse_move.sock, or leaves it out if that isn't set.
+ */
+#define CONTROL_SOCKET ""
+
 
 /******************************************************************************
  * KEY BINDINGS
@@ -126,10 +156,15 @@
 #define K_LEFT      KEY_H
 #define K_RIGHT     KEY_L
 
-/* Mouse buttons */
+/*
+ * Mouse buttons. Side and extra are unbound (0), they fit a layer better,
+ * see README.md
+ */
 #define K_BUTTON_LEFT     KEY_S
 #define K_BUTTON_MIDDLE   KEY_E
 #define K_BUTTON_RIGHT    KEY_F
+#define K_BUTTON_SIDE     0
+#define K_BUTTON_EXTRA    0
 
 /* Scroll directions */
 #define K_SCROLL_UP       KEY_U
@@ -137,6 +172,22 @@
 #define K_SCROLL_LEFT     KEY_B
 #define K_SCROLL_RIGHT    KEY_W
 
+/* Grid jumps and marks, see SCREEN SETTINGS */
+#define K_GRID            KEY_G
+#define K_MARK            KEY_M
+#define K_RECALL          KEY_APOSTROPHE
+
+/*
+ * Type with keys that have no binding without leaving mouse mode: they are
+ * forwarded to a second virtual keyboard while grabbing. 0 swallows them.
+ */
+#define PASSTHROUGH_KEYS  1
+
+/*
+ * Up to three more layers, e.g. fine motion or scroll-only, are set up in
+ * the config file with layer_hold_N or layer_toggle_N keys, see README.md.
+ */
+
 
 /******************************************************************************
  * SPEED SETTINGS
@@ -153,6 +204,16 @@
 #define SPEED_NORMAL   800
 #define SPEED_FAST     1200
 
+/*
+ * Motion acceleration: { hold time (ms), speed (%) } points, linearly
+ * interpolated, applied on top of the speeds above. Before the first point
+ * and after the last one the speed stays at that point's value, at most
+ * 10000%. The default keeps a constant speed, e.g.
+ *     { { 0, 100 }, { 150, 100 }, { 600, 250 } }
+ * starts at the normal speed and ramps to 2.5x between 150 ms and 600 ms.
+ */
+#define MOTION_ACCEL_CURVE { { 0, 100 } }
+
 /* Scrolling speeds (scroll steps per second) */
 #define SCROLL_SPEED_SLOWER   8
 #define SCROLL_SPEED_SLOW     12
@@ -160,6 +221,22 @@
 #define SCROLL_SPEED_FAST     30
 
 
+/******************************************************************************
+ * SCREEN SETTINGS
+ ******************************************************************************/
+
+/*
+ * Size of the whole desktop in pixels, for the absolute pointer behind grid
+ * mode and marks. K_GRID starts grid mode: the pointer jumps to the center
+ * of the screen and each motion key keeps that half of the region, a click
+ * or K_GRID again ends it. K_MARK then any key saves the pointer position
+ * under that key, K_RECALL then the key jumps back to it. The config file
+ * can change it at runtime (screen_width, screen_height).
+ */
+#define SCREEN_WIDTH      1920
+#define SCREEN_HEIGHT     1080
+
+
 /******************************************************************************
  * TIMING & DELAYS
  ******************************************************************************/
@@ -167,11 +244,60 @@
 /* Minimum delay between clicks (ms) */
 #define CLICK_DELAY_MS    25
 
-/* Scroll update interval (ms) */
+/* Scroll update interval (ms) when SCROLL_HI_RES is 0 */
 #define SCROLL_DELAY_MS   20
 
-/* Motion update interval (ms) — lower = smoother*/
-#define MOTION_DELAY_MS   10
+/*
+ * Smooth scrolling in 1/120 notch steps (REL_WHEEL_HI_RES) at
+ * MOTION_RATE_HZ, 0 for whole notches every SCROLL_DELAY_MS
+ */
+#define SCROLL_HI_RES     1
+
+/*
+ * Kinetic scrolling: after the scroll key is released scrolling carries on
+ * and slows down, losing about two thirds of its speed every
+ * SCROLL_KINETIC_MS. 0 stops with the key.
+ */
+#define SCROLL_KINETIC_MS 0
+
+/*
+ * Motion updates per second, up to 1000. Set it to at least the refresh rate
+ * of the display, 144 or 240 Hz moves in one step per frame. The timer only
+ * runs while a motion key is held, idle CPU is the same at any rate.
+ */
+#define MOTION_RATE_HZ    250
+
+
+/******************************************************************************
+ * STATS
+ ******************************************************************************/
+
+/*
+ * Counters (wakeups, events, uinput frames, grabs, time grabbed) and latency
+ * histograms (key -> click, key -> first motion, tick jitter) are always
+ * collected, and printed as one key=value line on SIGUSR1
+ * (kill -USR1 $(pidof mouse_move)) and on exit.
+ * Set STATS_FILE to also append that line every STATS_INTERVAL_S seconds.
+ */
+#define STATS_FILE        ""
+#define STATS_INTERVAL_S  60
+
+
+/******************************************************************************
+ * REALTIME
+ ******************************************************************************/
+
+/*
+ * Opt-in low-jitter mode for machines that are kept busy. A priority of
+ * 1-99 runs the daemon under REALTIME_POLICY (SCHED_FIFO or SCHED_RR) with
+ * all of its memory locked, so motion keeps its pace when every core is
+ * compiling. 0 leaves the normal scheduler. REALTIME_CPU pins the daemon to
+ * one CPU, -1 lets it migrate. Needs root, or CAP_SYS_NICE and CAP_IPC_LOCK.
+ * Compare tick_jitter in the stats with and without it.
+ */
+#define REALTIME_PRIORITY 0
+#define REALTIME_POLICY   SCHED_FIFO
+#define REALTIME_CPU      -1
 
 
 #endif /* CONFIG_H */
@@ -1,501 +1,3971 @@
+#define _GNU_SOURCE // CPU_SET, sched_setaffinity
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <time.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <poll.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stdarg.h>
+#include <sched.h>
 #include <libevdev/libevdev.h>
 #include <libevdev/libevdev-uinput.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <linux/input.h>
+#ifdef MOUSE_MOVE_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#endif
+#include <sys/eventfd.h>
+#ifdef MOUSE_MOVE_THREADS
+#include <pthread.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#endif
+#if defined(MOUSE_MOVE_IO_URING) && defined(MOUSE_MOVE_THREADS)
+#error "IO_URING=1 and THREADS=1 are two ways to read the keyboards, pick one"
+#endif
 
 #define MAX_DEVICE_PATH_SIZE 64
-#define KEY_STATE_MAX ((KEY_MAX + 7) / 8)
+#define EVENT_BUFFER_SIZE 64
+#define FRAME_MAX_EVENTS 16
+#define MAX_KEYBOARDS 16
+#define DEVICE_ID_SIZE 128
+#define RECONNECT_POLL_MS 250 // sysfs rescan while waiting for a lost keyboard
+#define INPUT_DIR "/dev/input"
+#define SYSFS_INPUT_DIR "/sys/class/input"
+#define BITS_PER_LONG (sizeof(long) * 8)
+#define NLONGS(n) (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define ACCEL_LUT_SIZE 512
+#define ACCEL_LUT_STEP_NS (4 * 1000000ULL) // finest step, longer curves get a coarser one
+#define MOTION_MAX_DT_NS (100 * 1000000ULL)
+#define MAX_MOTION_RATE_HZ 1000
+#define MAX_SPEED 100000 // px/s and scroll notches/s a config may ask for
+#define MAX_SCREEN_SIZE 65536 // px, either side
+#define FIXED_SHIFT 16
+#define FIXED_ONE (1 << FIXED_SHIFT)
+#define FIXED_SQRT1_2 46341 // 1/sqrt(2) in 16.16
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+#define MAX_COMBO_KEYS 8
+#define MAX_MARKS 32
+#define MAX_LAYERS 4 // the base layer and three more
+#define MAX_CLIENTS 8
+#define CONTROL_LINE_SIZE 256
+#define CONTROL_OUT_SIZE 4096
+#define WHEEL_UNITS_PER_NOTCH 120 // REL_WHEEL_HI_RES units
+#define SCROLL_MIN_VELOCITY 0.5f // notches/s, kinetic scrolling stops below
+#define MAX_ACCEL_POINTS 16
+#define MAX_ACCEL_PERCENT 10000 // 100x, far inside the 16.16 factor
+#define MAX_CONFIG_LINE 512
+#define KEY_WORDS NLONGS(KEY_CNT) // key bitmap as EVIOCGKEY returns it, 96 bytes
+#define STACK_PREFAULT_SIZE (256 * 1024)
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 #include "config.h"
+#include "mouse_move_state.h"
+
+#define RECORD_MAGIC "MMREC1\0\0"
+
+#ifdef MOUSE_MOVE_REPLAY
+// the replay harness has no devices: grabs succeed and no key is ever held
+#define evdev_ioctl(fd, request, arg) ((void)(fd), (void)(arg), 0)
+#else
+#define evdev_ioctl ioctl
+#endif
+
+typedef enum {
+	ACTION_NONE,
+	ACTION_UP,
+	ACTION_DOWN,
+	ACTION_LEFT,
+	ACTION_RIGHT,
+	ACTION_BUTTON_LEFT,
+	ACTION_BUTTON_MIDDLE,
+	ACTION_BUTTON_RIGHT,
+	ACTION_BUTTON_SIDE,
+	ACTION_BUTTON_EXTRA,
+	ACTION_SCROLL_UP,
+	ACTION_SCROLL_DOWN,
+	ACTION_SCROLL_LEFT,
+	ACTION_SCROLL_RIGHT,
+	ACTION_SLOWER,
+	ACTION_SLOW,
+	ACTION_FAST,
+	ACTION_GRID,
+	ACTION_MARK,
+	ACTION_RECALL,
+	// layer 1 to MAX_LAYERS - 1, while held or until pressed again
+	ACTION_LAYER_HOLD_1,
+	ACTION_LAYER_HOLD_2,
+	ACTION_LAYER_HOLD_3,
+	ACTION_LAYER_TOGGLE_1,
+	ACTION_LAYER_TOGGLE_2,
+	ACTION_LAYER_TOGGLE_3,
+	ACTION_COUNT,
+} Action;
+
+// in a layer above the base one: whatever the base layer binds
+#define ACTION_INHERIT 0xff
+
+#define ACTION_BIT(a) (1u << (a))
+#define ACTION_RANGE(first, last) ((ACTION_BIT(last) << 1) - ACTION_BIT(first))
+#define MOTION_ACTIONS ACTION_RANGE(ACTION_UP, ACTION_RIGHT)
+#define SCROLL_ACTIONS ACTION_RANGE(ACTION_SCROLL_UP, ACTION_SCROLL_RIGHT)
+#define BUTTON_ACTIONS ACTION_RANGE(ACTION_BUTTON_LEFT, ACTION_BUTTON_EXTRA)
+#define TIER_ACTIONS ACTION_RANGE(ACTION_SLOWER, ACTION_FAST)
+#define LAYER_HOLD_ACTIONS ACTION_RANGE(ACTION_LAYER_HOLD_1, ACTION_LAYER_HOLD_3)
+#define LAYER_TOGGLE_ACTIONS ACTION_RANGE(ACTION_LAYER_TOGGLE_1, ACTION_LAYER_TOGGLE_3)
+
+// action names as written in the config file
+static const char* const action_names[ACTION_COUNT] = {
+	[ACTION_NONE] = "none",
+	[ACTION_UP] = "up",
+	[ACTION_DOWN] = "down",
+	[ACTION_LEFT] = "left",
+	[ACTION_RIGHT] = "right",
+	[ACTION_BUTTON_LEFT] = "button_left",
+	[ACTION_BUTTON_MIDDLE] = "button_middle",
+	[ACTION_BUTTON_RIGHT] = "button_right",
+	[ACTION_BUTTON_SIDE] = "button_side",
+	[ACTION_BUTTON_EXTRA] = "button_extra",
+	[ACTION_SCROLL_UP] = "scroll_up",
+	[ACTION_SCROLL_DOWN] = "scroll_down",
+	[ACTION_SCROLL_LEFT] = "scroll_left",
+	[ACTION_SCROLL_RIGHT] = "scroll_right",
+	[ACTION_SLOWER] = "slower",
+	[ACTION_SLOW] = "slow",
+	[ACTION_FAST] = "fast",
+	[ACTION_GRID] = "grid",
+	[ACTION_MARK] = "mark",
+	[ACTION_RECALL] = "recall",
+	[ACTION_LAYER_HOLD_1] = "layer_hold_1",
+	[ACTION_LAYER_HOLD_2] = "layer_hold_2",
+	[ACTION_LAYER_HOLD_3] = "layer_hold_3",
+	[ACTION_LAYER_TOGGLE_1] = "layer_toggle_1",
+	[ACTION_LAYER_TOGGLE_2] = "layer_toggle_2",
+	[ACTION_LAYER_TOGGLE_3] = "layer_toggle_3",
+};
+
+// unit direction of the motion and scroll actions, scroll up is +y like REL_WHEEL
+static const struct {
+	int8_t x;
+	int8_t y;
+} action_directions[ACTION_COUNT] = {
+	[ACTION_UP] = { 0, -1 },
+	[ACTION_DOWN] = { 0, 1 },
+	[ACTION_LEFT] = { -1, 0 },
+	[ACTION_RIGHT] = { 1, 0 },
+	[ACTION_SCROLL_UP] = { 0, 1 },
+	[ACTION_SCROLL_DOWN] = { 0, -1 },
+	[ACTION_SCROLL_LEFT] = { -1, 0 },
+	[ACTION_SCROLL_RIGHT] = { 1, 0 },
+};
+
+static const uint16_t action_buttons[ACTION_COUNT] = {
+	[ACTION_BUTTON_LEFT] = BTN_LEFT,
+	[ACTION_BUTTON_MIDDLE] = BTN_MIDDLE,
+	[ACTION_BUTTON_RIGHT] = BTN_RIGHT,
+	[ACTION_BUTTON_SIDE] = BTN_SIDE,
+	[ACTION_BUTTON_EXTRA] = BTN_EXTRA,
+};
+
+typedef enum {
+	TIER_SLOWER,
+	TIER_SLOW,
+	TIER_NORMAL,
+	TIER_FAST,
+	TIER_COUNT,
+} Tier;
+
+static const Tier action_tiers[ACTION_COUNT] = {
+	[ACTION_SLOWER] = TIER_SLOWER,
+	[ACTION_SLOW] = TIER_SLOW,
+	[ACTION_FAST] = TIER_FAST,
+};
+
+typedef enum {
+	MODE_IDLE,         // keyboards untouched, waiting for the start combo
+	MODE_PENDING_GRAB, // start combo seen, waiting for every key to go up
+	MODE_GRABBING,     // keyboards grabbed, keys drive the mouse
+} Mode;
+
+static const char* const mode_names[] = {
+	[MODE_IDLE] = "idle",
+	[MODE_PENDING_GRAB] = "pending",
+	[MODE_GRABBING] = "grabbing",
+};
+
+static const char* const tier_names[TIER_COUNT] = {
+	[TIER_SLOWER] = "slower",
+	[TIER_SLOW] = "slow",
+	[TIER_NORMAL] = "normal",
+	[TIER_FAST] = "fast",
+};
 
-#define CLICK_DELAY_NS  (CLICK_DELAY_MS * 1000000)
-#define SCROLL_DELAY_NS (SCROLL_DELAY_MS * 1000000)
-#define MOTION_DELAY_NS (MOTION_DELAY_MS * 1000000)
-
-#define POLL_DELAY_MS MIN(MIN(CLICK_DELAY_MS, SCROLL_DELAY_MS), MOTION_DELAY_MS)
-
-static const int kill_combo_keys[] = KILL_COMBO_KEYS;
-static const size_t kill_combo_keys_size = sizeof(kill_combo_keys) / sizeof(kill_combo_keys[0]);
-
-static const int start_combo_keys[] = START_COMBO_KEYS;
-static const size_t start_combo_keys_size = sizeof(start_combo_keys) / sizeof(start_combo_keys[0]);
+typedef struct {
+	int keys[MAX_COMBO_KEYS];
+	size_t size;
+	unsigned long mask[KEY_WORDS]; // keys as a bitmap, matched word by word
+} Combo;
+
+/*
+ * Runtime settings: the config.h defaults with the config file applied on
+ * top, compiled into lookup tables. keymap maps a layer and keycode straight
+ * to its action, so dispatch costs the same however many keys and layers
+ * are bound.
+ */
+typedef struct {
+	uint8_t keymap[MAX_LAYERS][KEY_CNT];
+	int bind_layer; // layer that bind lines go to while parsing
+	int motion_speeds[TIER_COUNT];
+	int scroll_speeds[TIER_COUNT];
+	int click_delay_ms;
+	int scroll_delay_ms;
+	int motion_rate_hz;
+	int scroll_hi_res;
+	int scroll_kinetic_ms;
+	int screen_width; // px, the range of the absolute pointer
+	int screen_height;
+	Combo start_combo;
+	Combo exit_combo;
+	Combo kill_combo;
+	int accel_curve[MAX_ACCEL_POINTS][2];
+	size_t accel_curve_size;
+	// hold time -> speed multiplier (16.16), one entry per accel_lut_step_ns
+	uint32_t accel_lut[ACCEL_LUT_SIZE];
+	size_t accel_lut_size;
+	uint64_t accel_lut_step_ns;
+	unsigned long bound_keys[KEY_WORDS]; // keys with an action on any layer
+} Config;
+
+// swapped as a whole on reload
+static Config* config;
+static char config_path[PATH_MAX];
+// KEYBOARD_DEVICE, or -d
+static const char* keyboard_device = KEYBOARD_DEVICE;
+
+// a saved pointer position, named by the key pressed after the mark key
+typedef struct {
+	int code;
+	int x;
+	int y;
+} Mark;
 
-static const int exit_combo_keys[] = EXIT_COMBO_KEYS;
-static const size_t exit_combo_keys_size = sizeof(exit_combo_keys) / sizeof(exit_combo_keys[0]);
+// events for one uinput report, flushed with a single writev
+typedef struct {
+	struct input_event events[FRAME_MAX_EVENTS];
+	size_t count;
+} Frame;
 
 typedef struct {
 	struct libevdev_uinput* uidev;
-	int* key_states;
+	int uifd;
+	Frame frame;
+	unsigned long keys[KEY_WORDS]; // keys held on any keyboard
+	// keys held per action, and the bit of every action held at least once
+	uint8_t action_counts[ACTION_COUNT];
+	uint32_t actions;
 	int motion_speed;
-	float motion_fraction_x;
-	float motion_fraction_y;
+	Tier base_tier; // used while no speed modifier is held, set over the control socket
+	// sub-pixel remainders in 16.16 fixed point
+	int64_t motion_remainder_x;
+	int64_t motion_remainder_y;
+	uint64_t motion_start; // first step of the current movement, 0 when still
+	uint64_t motion_last;  // previous step, motion integrates over the real dt
+	// input_event time of the key behind a pending output, 0 when nothing pending
+	uint64_t click_key_time;
+	uint64_t motion_key_time;
 	int scroll_speed;
+	// notches/s, held keys set it and with kinetic scrolling it decays after release
+	float scroll_velocity_x;
+	float scroll_velocity_y;
+	// hi-res units not sent yet, and sent units not yet making a legacy notch
 	float scroll_fraction_x;
 	float scroll_fraction_y;
-	struct timespec click_tick;
-	struct timespec scroll_tick;
-	struct timespec motion_tick;
-	bool button_left_pressed;
-	bool button_middle_pressed;
-	bool button_right_pressed;
+	int scroll_notch_x;
+	int scroll_notch_y;
+	// absolute CLOCK_MONOTONIC deadlines in ns, 0 = not scheduled
+	uint64_t click_deadline;
+	uint64_t scroll_deadline;
+	uint64_t motion_deadline;
+	uint32_t buttons_pressed; // BUTTON_ACTIONS bits as last sent
+	int layer;         // keymap layer keys are looked up in
+	int toggled_layer; // layer used while no layer key is held
+	// passthrough keyboard for unbound keys, kbd_fd is -1 when there is none
+	struct libevdev_uinput* kbd_uidev;
+	int kbd_fd;
+	Frame kbd_frame; // forwarded keys of the current source packet
+	unsigned long forwarded[KEY_WORDS]; // keys held down on the passthrough keyboard
+	// absolute device for grid jumps and marks, abs_fd is -1 when there is none
+	struct libevdev_uinput* abs_uidev;
+	int abs_fd;
+	// pointer position, known after a jump and then followed from our own motion
+	int pos_x;
+	int pos_y;
+	// grid mode: motion keys halve this region and the pointer jumps to its center
+	bool grid_active;
+	int grid_x;
+	int grid_y;
+	int grid_w;
+	int grid_h;
+	Action mark_pending; // ACTION_MARK or ACTION_RECALL waiting for the key naming the mark
+	int mark_key;        // that key, ignored until it is released
+	Mark marks[MAX_MARKS];
+	size_t marks_count;
 } Mouse;
 
-static uint64_t time_diff_ns(struct timespec* x, struct timespec* y) {
-	uint64_t nx = (uint64_t)x->tv_sec * 1000000000ULL + x->tv_nsec;
-	uint64_t ny = (uint64_t)y->tv_sec * 1000000000ULL + y->tv_nsec;
-	if(ny > nx) return 0;
-	return nx - ny;
-}
-
-static void handle_motion(Mouse* m) {
-	int x = 0;
-	int y = 0;
-	if(m->key_states[K_UP]) y--;
-	if(m->key_states[K_DOWN]) y++;
-	if(m->key_states[K_LEFT]) x--;
-	if(m->key_states[K_RIGHT]) x++;
-	if(x == 0 && y == 0) return;
-	
-	m->motion_speed = SPEED_NORMAL;
-	if(m->key_states[FAST_MOD]) m->motion_speed = SPEED_FAST;
-	if(m->key_states[SLOW_MOD]) m->motion_speed = SPEED_SLOW;
-	if(m->key_states[SLOWER_MOD]) m->motion_speed = SPEED_SLOWER;
+typedef struct {
+	int fd; // -1 when the slot is free
+	char path[MAX_DEVICE_PATH_SIZE];
+	char id[DEVICE_ID_SIZE]; // bus:vendor:product and name, survives renumbering
+	unsigned long keys[KEY_WORDS]; // keys held on this device
+	unsigned long mask[KEY_WORDS]; // EV_KEY codes the kernel passes on, see update_event_masks
+	bool masked; // mask and the filter on other event types are installed
+	bool dropped;
+} Keyboard;
+
+// a keyboard that went away, waited for until RECONNECT_TIMEOUT_MS
+typedef struct {
+	char id[DEVICE_ID_SIZE];
+	uint64_t time;
+} LostKeyboard;
 
-	// speed per second
-	float motion_factor = m->motion_speed * (MOTION_DELAY_MS / 1e3f);
+// fixed slots so epoll can refer to a keyboard by index
+typedef struct {
+	Keyboard devices[MAX_KEYBOARDS];
+	LostKeyboard lost[MAX_KEYBOARDS];
+	int lost_count;
+} Keyboards;
+
+// epoll sources that are not keyboards, keyboards use their slot index
+enum {
+	SOURCE_TIMER = MAX_KEYBOARDS,
+	SOURCE_HOTPLUG,
+	SOURCE_SIGNAL,
+	SOURCE_STATS_TIMER,
+	SOURCE_CONFIG,
+	SOURCE_CONTROL,
+	SOURCE_RECONNECT,
+	SOURCE_INPUT, // transitions from the input thread
+	SOURCE_CLIENT, // first of MAX_CLIENTS control connections
+	SOURCE_COUNT = SOURCE_CLIENT + MAX_CLIENTS,
+};
+
+// a control socket connection, commands in and replies out are line based
+typedef struct {
+	int fd; // -1 when the slot is free
+	char in[CONTROL_LINE_SIZE];
+	size_t in_len;
+	char out[CONTROL_OUT_SIZE];
+	size_t out_len;
+	bool overflow;   // more output than fits, the client is dropped
+	bool want_write; // EPOLLOUT is armed
+	int notify_fd;   // eventfd for state block changes, -1 until state_fd
+	ssize_t fds_at;  // offset in out of the reply carrying the state fds, -1 for none
+} Client;
 
-	// accumulate movement less than a pixel
-	m->motion_fraction_x += x * motion_factor;
-	m->motion_fraction_y += y * motion_factor;
-	int x_pixels = (int) m->motion_fraction_x;
-	int y_pixels = (int) m->motion_fraction_y;
-	m->motion_fraction_x -= x_pixels;
-	m->motion_fraction_y -= y_pixels;
+typedef struct {
+	int fd; // -1 without a control socket
+	char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+	Client clients[MAX_CLIENTS];
+} Control;
 
-	if(x_pixels != 0) {
-		libevdev_uinput_write_event(m->uidev, EV_REL, REL_X, x_pixels);
+// plain counters, only ever touched by the main thread
+typedef struct {
+	uint64_t start; // now_ns() at startup
+	uint64_t wakeups; // event loop iterations
+	uint64_t reads;
+	uint64_t events;
+	uint64_t discarded; // neither EV_KEY nor EV_SYN, the event masks should keep this at 0
+	uint64_t syn_dropped;
+	uint64_t syscalls; // made for keyboard input, ticks and uinput output
+	uint64_t frames; // written to uinput, each ending in one SYN_REPORT
+	uint64_t empty_ticks; // motion or scroll ticks that had nothing to send
+	uint64_t grab_attempts;
+	uint64_t grab_start; // 0 while not grabbing
+	uint64_t grabbed_ns; // of finished grabs
+} Stats;
+
+static Stats stats;
+
+// the block shared with status bars, see mouse_move_state.h
+static struct {
+	int fd; // memfd, -1 without a state block
+	struct mouse_move_state* block;
+} shared_state = { .fd = -1 };
+
+#ifdef MOUSE_MOVE_IO_URING
+#define URING_ENTRIES 64
+#define URING_WRITE_SLOTS 32
+
+// what a completion belongs to, in the top byte of user_data
+enum {
+	URING_READ = 1, // then the read generation and the keyboard slot
+	URING_POLL,     // the poll a read is linked behind, completes silently
+	URING_EPOLL,    // one of the epoll sources is ready
+	URING_WRITE,    // then the write slot
+	URING_CANCEL,
+};
+#define URING_DATA(kind, gen, index) ((uint64_t)(kind) << 56 | ((uint64_t)(gen) & 0xffffff) << 32 | (index))
+
+/*
+ * Raw io_uring, no liburing: one shared mmap for both rings, every
+ * submission queued locally and handed to the kernel by the
+ * io_uring_enter that also waits for the next completion.
+ */
+typedef struct {
+	int fd;
+	void* rings;
+	size_t rings_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_local_tail; // queued, not yet visible to the kernel
+	unsigned to_submit;
+	unsigned writes_queued; // uinput writes complete during submission
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+	uint32_t read_gen[MAX_KEYBOARDS]; // completions of an older generation are stale
+	struct input_event read_buffers[MAX_KEYBOARDS][EVENT_BUFFER_SIZE];
+	// a frame is copied here, it has to outlive the submission
+	struct input_event writes[URING_WRITE_SLOTS][FRAME_MAX_EVENTS];
+	bool write_busy[URING_WRITE_SLOTS];
+} Ring;
+
+// NULL: the epoll path, also when the ring could not be set up
+static Ring* uring;
+
+// hand everything queued to the kernel, and with wait block for a completion or timeout_ns
+static int uring_enter(Ring* r, bool wait, uint64_t timeout_ns) {
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout_ns / 1000000000ULL,
+		.tv_nsec = timeout_ns % 1000000000ULL,
+	};
+	struct io_uring_getevents_arg arg = { .ts = (uintptr_t) &ts };
+	unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	if(wait && timeout_ns != 0) {
+		flags |= IORING_ENTER_EXT_ARG;
 	}
-	if(y_pixels != 0) {
-		libevdev_uinput_write_event(m->uidev, EV_REL, REL_Y, y_pixels);
+	// their completions are not what we wait for, one more is
+	unsigned min_complete = wait ? r->writes_queued + 1 : 0;
+	__atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+	stats.syscalls++;
+	int ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, min_complete, flags,
+		(flags & IORING_ENTER_EXT_ARG) ? &arg : NULL, sizeof(arg));
+	if(ret > 0) {
+		r->to_submit -= MIN((unsigned) ret, r->to_submit);
+	}
+	if(r->to_submit == 0) {
+		r->writes_queued = 0;
 	}
-	libevdev_uinput_write_event(m->uidev, EV_SYN, SYN_REPORT, 0);
+	return ret;
 }
 
-static void handle_scroll(Mouse* m) {
-	int x = 0;
-	int y = 0;
-	if(m->key_states[K_SCROLL_UP]) y++;
-	if(m->key_states[K_SCROLL_DOWN]) y--;
-	if(m->key_states[K_SCROLL_LEFT]) x--;
-	if(m->key_states[K_SCROLL_RIGHT]) x++;
-	if(x == 0 && y == 0) return;
-
-	m->scroll_speed = SCROLL_SPEED_NORMAL;
-	if(m->key_states[FAST_MOD]) m->scroll_speed = SCROLL_SPEED_FAST;
-	if(m->key_states[SLOW_MOD]) m->scroll_speed = SCROLL_SPEED_SLOW;
-	if(m->key_states[SLOWER_MOD]) m->scroll_speed = SCROLL_SPEED_SLOWER;
+static struct io_uring_sqe* uring_sqe(Ring* r) {
+	if(r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->sq_entries) {
+		uring_enter(r, false, 0);
+	}
+	unsigned index = r->sq_local_tail++ & r->sq_mask;
+	struct io_uring_sqe* sqe = &r->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[index] = index;
+	r->to_submit++;
+	return sqe;
+}
 
-	// scroll speed per second
-	float scroll_factor = m->scroll_speed * (SCROLL_DELAY_MS / 1e3f);
+static Ring* uring_create(void) {
+	struct io_uring_params p = { 0 };
+	int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if(fd < 0) {
+		return NULL;
+	}
+	// 5.17: one mmap for both rings, a timeout on the wait itself, silent polls
+	unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG | IORING_FEAT_CQE_SKIP;
+	if((p.features & needed) != needed) {
+		close(fd);
+		errno = ENOSYS;
+		return NULL;
+	}
+	Ring* r = calloc(1, sizeof(*r));
+	if(r == NULL) {
+		close(fd);
+		return NULL;
+	}
+	r->fd = fd;
+	r->rings_size = MAX(p.sq_off.array + p.sq_entries * sizeof(unsigned), p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+	r->rings = mmap(NULL, r->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if(r->rings == MAP_FAILED || r->sqes == MAP_FAILED) {
+		if(r->rings != MAP_FAILED) munmap(r->rings, r->rings_size);
+		if(r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+		close(fd);
+		free(r);
+		return NULL;
+	}
+	char* base = r->rings;
+	r->sq_head = (unsigned*)(base + p.sq_off.head);
+	r->sq_tail = (unsigned*)(base + p.sq_off.tail);
+	r->sq_array = (unsigned*)(base + p.sq_off.array);
+	r->sq_mask = *(unsigned*)(base + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->sq_local_tail = *r->sq_tail;
+	r->cq_head = (unsigned*)(base + p.cq_off.head);
+	r->cq_tail = (unsigned*)(base + p.cq_off.tail);
+	r->cq_mask = *(unsigned*)(base + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+	return r;
+}
 
-	// store small scroll deltas, scroll if 1 is reached
-	m->scroll_fraction_x += x * scroll_factor;
-	m->scroll_fraction_y += y * scroll_factor;
-	int x_scroll = (int) m->scroll_fraction_x;
-	int y_scroll = (int) m->scroll_fraction_y;
-	m->scroll_fraction_x -= x_scroll;
-	m->scroll_fraction_y -= y_scroll;
+static void uring_destroy(Ring* r) {
+	// frames queued on the way out, releases above all
+	uring_enter(r, false, 0);
+	munmap(r->sqes, r->sqes_size);
+	munmap(r->rings, r->rings_size);
+	close(r->fd);
+	free(r);
+}
 
-	if(x_scroll != 0) {
-		libevdev_uinput_write_event(m->uidev, EV_REL, REL_HWHEEL, x_scroll);
+// queue a uinput frame, it goes out with the next io_uring_enter
+static void uring_write(Ring* r, int fd, const struct input_event* events, size_t count) {
+	int slot = -1;
+	for(int i = 0; i < URING_WRITE_SLOTS; i++) {
+		if(!r->write_busy[i]) {
+			slot = i;
+			break;
+		}
 	}
-	if(y_scroll != 0) {
-		libevdev_uinput_write_event(m->uidev, EV_REL, REL_WHEEL, y_scroll);
+	if(slot < 0) {
+		// every copy in flight: push them out first so this frame stays behind them
+		uring_enter(r, false, 0);
+		stats.syscalls++;
+		if(write(fd, events, count * sizeof(events[0])) < 0) {
+			perror("Error writing to uinput");
+		}
+		return;
 	}
-	libevdev_uinput_write_event(m->uidev, EV_SYN, SYN_REPORT, 0);
+	memcpy(r->writes[slot], events, count * sizeof(events[0]));
+	r->write_busy[slot] = true;
+	struct io_uring_sqe* sqe = uring_sqe(r);
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) r->writes[slot];
+	sqe->len = count * sizeof(events[0]);
+	sqe->off = -1;
+	sqe->user_data = URING_DATA(URING_WRITE, 0, slot);
+	r->writes_queued++;
 }
 
-static void update_button(struct libevdev_uinput* uidev, bool is_pressed, bool* pressed_flag, int ui_btn) {
-	if(is_pressed != *pressed_flag) {
-			*pressed_flag = is_pressed;
-			libevdev_uinput_write_event(uidev, EV_KEY, ui_btn, is_pressed);
-	}
+/*
+ * Read the keyboard in slot once it has events. The read is linked behind
+ * a poll because the fd is O_NONBLOCK, a bare read would just fail with
+ * EAGAIN. Both go out with the next io_uring_enter.
+ */
+static void uring_read(Ring* r, int fd, int slot) {
+	uint32_t gen = r->read_gen[slot];
+	struct io_uring_sqe* sqe = uring_sqe(r);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+	sqe->user_data = URING_DATA(URING_POLL, gen, slot);
+
+	sqe = uring_sqe(r);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) r->read_buffers[slot];
+	sqe->len = sizeof(r->read_buffers[slot]);
+	sqe->off = -1;
+	sqe->user_data = URING_DATA(URING_READ, gen, slot);
 }
-static void handle_click(Mouse* m) {
-	update_button(m->uidev, (bool) m->key_states[K_BUTTON_LEFT], &m->button_left_pressed, BTN_LEFT);
-	update_button(m->uidev, (bool) m->key_states[K_BUTTON_MIDDLE], &m->button_middle_pressed, BTN_MIDDLE);
-	update_button(m->uidev, (bool) m->key_states[K_BUTTON_RIGHT], &m->button_right_pressed, BTN_RIGHT);
-	libevdev_uinput_write_event(m->uidev, EV_SYN, SYN_REPORT, 0);
+
+// one completion whenever epoll_fd becomes readable, until cancelled
+static void uring_poll_epoll(Ring* r, int epoll_fd) {
+	struct io_uring_sqe* sqe = uring_sqe(r);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = epoll_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = URING_DATA(URING_EPOLL, 0, epoll_fd);
 }
 
+/*
+ * Drop the reads on a keyboard that is about to be closed, before the fd
+ * number is gone. Cancelled by user_data rather than by fd, which would
+ * need 5.19: cancelling the poll also ends the read linked behind it.
+ */
+static void uring_cancel(Ring* r, int slot) {
+	uint32_t gen = r->read_gen[slot]++;
+	const unsigned kinds[] = { URING_POLL, URING_READ };
+	for(size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+		struct io_uring_sqe* sqe = uring_sqe(r);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = URING_DATA(kinds[i], gen, slot);
+		sqe->user_data = URING_DATA(URING_CANCEL, 0, 0);
+	}
+	uring_enter(r, false, 0);
+}
+#endif
 
-static void handle_mouse(Mouse* m) {
-	struct timespec now;
-	clock_gettime(CLOCK_MONOTONIC, &now);
+/*
+ * Log-bucketed histogram of nanosecond values: 2^HIST_SUB_BITS buckets per
+ * power of two, so percentiles are within 12.5% and adding is a handful of
+ * instructions. Cheap enough to stay on in production.
+ */
+typedef struct {
+	uint64_t buckets[HIST_BUCKETS];
+	uint64_t count;
+	uint64_t max;
+} Histogram;
 
-	if(time_diff_ns(&now, &m->click_tick) > CLICK_DELAY_NS) {
-		handle_click(m);
-		clock_gettime(CLOCK_MONOTONIC, &m->click_tick);
+typedef struct {
+	Histogram key_to_click;  // button key event -> BTN_* written
+	Histogram key_to_motion; // first motion key event -> first REL_X/REL_Y written
+	Histogram tick_jitter;   // tick handled - tick deadline
+	Histogram grab_activation; // last key release after the start combo -> keyboards grabbed
+} Latency;
+
+static Latency latency;
+
+// one input_event as stored by -r, timestamps are CLOCK_MONOTONIC
+typedef struct {
+	uint64_t time_ns;
+	uint16_t type;
+	uint16_t code;
+	int32_t value;
+} Record;
+
+static FILE* record_file;
+
+#ifdef MOUSE_MOVE_REPLAY
+static void replay_sink(const struct input_event* events, size_t count);
+#endif
+
+static void frame_add(Frame* f, uint16_t type, uint16_t code, int32_t value) {
+	// keep the last slot for SYN_REPORT
+	if(f->count >= FRAME_MAX_EVENTS - 1) {
+		fprintf(stderr, "Output frame full, dropping event\n");
+		return;
+	}
+	struct input_event* ev = &f->events[f->count++];
+	ev->type = type;
+	ev->code = code;
+	ev->value = value;
+}
+
+// terminate the frame with one SYN_REPORT and write it out, nothing if empty
+static void frame_flush(Frame* f, int fd) {
+	if(f->count == 0) {
+		return;
+	}
+	frame_add(f, EV_SYN, SYN_REPORT, 0);
+	stats.frames++;
+#ifdef MOUSE_MOVE_REPLAY
+	(void) fd;
+	replay_sink(f->events, f->count);
+#else
+#ifdef MOUSE_MOVE_IO_URING
+	if(uring != NULL) {
+		uring_write(uring, fd, f->events, f->count);
+		f->count = 0;
+		return;
+	}
+#endif
+	struct iovec iov = {
+		.iov_base = f->events,
+		.iov_len = f->count * sizeof(f->events[0]),
+	};
+	stats.syscalls++;
+	if(writev(fd, &iov, 1) < 0) {
+		perror("Error writing to uinput");
 	}
+#endif
+	f->count = 0;
+}
 
-	if(time_diff_ns(&now, &m->scroll_tick) > SCROLL_DELAY_NS) {
-		handle_scroll(m);
-		clock_gettime(CLOCK_MONOTONIC, &m->scroll_tick);
+static void hist_add(Histogram* h, uint64_t value) {
+	size_t index = value;
+	if(value >= (1 << HIST_SUB_BITS)) {
+		int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+		index = ((size_t)(shift + 1) << HIST_SUB_BITS) | ((value >> shift) & ((1 << HIST_SUB_BITS) - 1));
+	}
+	h->buckets[index]++;
+	h->count++;
+	if(value > h->max) {
+		h->max = value;
 	}
+}
 
-	if(time_diff_ns(&now, &m->motion_tick) > MOTION_DELAY_NS) {
-		handle_motion(m);
-		clock_gettime(CLOCK_MONOTONIC, &m->motion_tick);
+// upper bound of the bucket holding the given fraction of samples
+static uint64_t hist_percentile(Histogram* h, double fraction) {
+	uint64_t target = (uint64_t)(fraction * h->count);
+	uint64_t seen = 0;
+	for(size_t i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if(seen > target) {
+			if(i < (1 << HIST_SUB_BITS)) {
+				return i;
+			}
+			int shift = (int)(i >> HIST_SUB_BITS) - 1;
+			uint64_t upper = (((i & ((1 << HIST_SUB_BITS) - 1)) | (1 << HIST_SUB_BITS)) + 1) << shift;
+			return MIN(upper - 1, h->max);
+		}
 	}
+	return h->max;
 }
 
+static uint64_t event_time_ns(struct input_event* event) {
+	return (uint64_t)event->input_event_sec * 1000000000ULL + event->input_event_usec * 1000ULL;
+}
 
-static struct libevdev_uinput* create_uinput_mouse_dev(int uifd) {
-	struct libevdev_uinput* ui_mouse_dev;
-	struct libevdev* mouse_dev;
-	int err;
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-	mouse_dev = libevdev_new();
-	if(mouse_dev == NULL) {
-		perror("Error creating virtual mouse device");
-		return NULL;
-	}
-	libevdev_set_name(mouse_dev, "virtual mouse");
-	libevdev_enable_event_type(mouse_dev, EV_REL);
-	libevdev_enable_event_code(mouse_dev, EV_REL, REL_X, NULL);
-	libevdev_enable_event_code(mouse_dev, EV_REL, REL_Y, NULL);
-	libevdev_enable_event_code(mouse_dev, EV_REL, REL_WHEEL, NULL);
-	libevdev_enable_event_code(mouse_dev, EV_REL, REL_HWHEEL, NULL);
+#ifdef MOUSE_MOVE_THREADS
+#define TRANSITION_RING_SIZE 1024 // power of two
+#define TRANSITION_ERROR 0xff // type of a failed read, value is the errno
+#define INPUT_KICK UINT64_MAX // epoll data of kick_fd
+#define INPUT_STACK_SIZE (256 * 1024)
 
-	libevdev_enable_event_type(mouse_dev, EV_KEY);
-	libevdev_enable_event_code(mouse_dev, EV_KEY, BTN_LEFT, NULL);
-	libevdev_enable_event_code(mouse_dev, EV_KEY, BTN_MIDDLE, NULL);
-	libevdev_enable_event_code(mouse_dev, EV_KEY, BTN_RIGHT, NULL);
+// a keyboard event as the reader hands it over, only EV_KEY and EV_SYN
+typedef struct {
+	uint64_t time_ns;
+	uint32_t gen; // of the slot when it was watched
+	int32_t value;
+	uint16_t code;
+	uint8_t type;
+	uint8_t slot;
+	bool first; // first of a read(2)
+} Transition;
+
+/*
+ * Two-thread mode: a reader thread drains the keyboards into a
+ * single-producer single-consumer ring and wakes the main thread, which
+ * owns the mouse and the ticks, through wake_fd. Neither side ever waits
+ * for the other while the ring has room; when it is full the reader leaves
+ * the events in the kernel and sleeps on kick_fd until the main thread
+ * caught up.
+ */
+typedef struct {
+	pthread_t thread;
+	int epoll_fd; // the keyboards and kick_fd, only the reader waits on it
+	int wake_fd;  // eventfd: transitions are waiting, on the main epoll
+	int kick_fd;  // eventfd: end the current round early
+	bool stop;
+	bool exited; // the reader gave up, nothing is read anymore
+	bool full; // the reader sleeps until the main thread pops and kicks
+	bool forgetting; // the main thread sleeps on rounds, see input_thread_forget
+	uint32_t gen[MAX_KEYBOARDS]; // transitions of an older generation are stale
+	uint32_t rounds; // epoll_wait rounds the reader finished, a futex
+	uint64_t discarded; // events neither EV_KEY nor EV_SYN, for stats.discarded
+	uint32_t head __attribute__((aligned(64))); // next to pop, written by the main thread
+	uint32_t tail __attribute__((aligned(64))); // next to push, written by the reader
+	Transition ring[TRANSITION_RING_SIZE];
+} InputThread;
+
+// NULL: keyboards are read by the main thread, also when the thread could not start
+static InputThread* input_thread;
+
+static uint32_t transition_room(InputThread* t) {
+	return TRANSITION_RING_SIZE - (t->tail - __atomic_load_n(&t->head, __ATOMIC_ACQUIRE));
+}
 
-	err = libevdev_uinput_create_from_device(mouse_dev, uifd, &ui_mouse_dev);
-	if(err != 0) {
-		perror("Error creating uinput mouse device");
-		libevdev_free(mouse_dev);
-		return NULL;
+// reader side, the caller checked transition_room
+static void transition_push(InputThread* t, const Transition* tr) {
+	t->ring[t->tail & (TRANSITION_RING_SIZE - 1)] = *tr;
+	__atomic_store_n(&t->tail, t->tail + 1, __ATOMIC_RELEASE);
+}
+
+static bool transition_pop(InputThread* t, Transition* tr) {
+	if(t->head == __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE)) {
+		return false;
 	}
-	libevdev_free(mouse_dev);
-	return ui_mouse_dev;
+	*tr = t->ring[t->head & (TRANSITION_RING_SIZE - 1)];
+	__atomic_store_n(&t->head, t->head + 1, __ATOMIC_RELEASE);
+	return true;
 }
 
-static int guess_keyboard_device_path(char* buff, size_t size) {
-	int fd;
-	int rc;
-	struct libevdev* dev = NULL;
+static long futex(uint32_t* addr, int op, uint32_t val) {
+	return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
 
-	for(int i = 0; i < MAX_DEVICES; i++) { 
-		snprintf(buff, size, "/dev/input/event%d", i);
+static void input_thread_kick(InputThread* t) {
+	uint64_t one = 1;
+	if(write(t->kick_fd, &one, sizeof(one)) < 0) {
+		perror("Failed to wake the input thread");
+	}
+}
 
-		fd = open(buff, O_RDONLY | O_NONBLOCK);
-		if(fd == -1) {
-			// If no such file, device does not exist, skip
-			if (errno == ENOENT)
-				continue;
-			// Permission denied or other errors - skip but warn maybe
-			if (errno == EACCES || errno == EPERM) {
-				fprintf(stderr, "Permission denied opening %s, skipping\n", buff);
-				continue;
-			}
-			perror("Error opening device");
-			break;
+/*
+ * Read one keyboard until it would block. A read only starts when all of
+ * it fits, returns false when the ring is too full for that.
+ */
+static bool input_thread_read(InputThread* t, uint64_t data) {
+	int fd = (int)(data & 0xffffffff);
+	Transition tr = {
+		.gen = data >> 40,
+		.slot = (data >> 32) & 0xff,
+	};
+	struct input_event events[EVENT_BUFFER_SIZE];
+	ssize_t bytes_read;
+
+	do {
+		if(transition_room(t) < EVENT_BUFFER_SIZE + 1) {
+			return false;
 		}
-		rc = libevdev_new_from_fd(fd, &dev);
-		if (rc < 0) {
-			close(fd);
-			fprintf(stderr, "Failed to init libevdev (%s)\n", strerror(-rc));
-			return 1;
+		bytes_read = read(fd, events, sizeof(events));
+		if(bytes_read < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return true;
+			}
+			tr.type = TRANSITION_ERROR;
+			tr.value = errno;
+			tr.first = true;
+			transition_push(t, &tr);
+			// it would keep failing until the main thread closes it
+			epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+			return true;
 		}
-		if(libevdev_has_event_code(dev, EV_KEY, KEY_A) && libevdev_has_event_type(dev, EV_KEY) && libevdev_has_event_type(dev, EV_REP)) {
-			// device is keyboard
-			libevdev_free(dev);
-			close(fd);
-			return 0;
+		size_t n = (size_t)bytes_read / sizeof(events[0]);
+		tr.first = true;
+		for(size_t i = 0; i < n; i++) {
+			if(events[i].type != EV_KEY && events[i].type != EV_SYN) {
+				__atomic_add_fetch(&t->discarded, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+			tr.time_ns = event_time_ns(&events[i]);
+			tr.type = events[i].type;
+			tr.code = events[i].code;
+			tr.value = events[i].value;
+			transition_push(t, &tr);
+			tr.first = false;
 		}
-		libevdev_free(dev);
-		close(fd);
+	} while(bytes_read == (ssize_t)sizeof(events));
+	return true;
+}
+
+// a round is over, wake the main thread if it waits for that
+static void input_thread_end_round(InputThread* t) {
+	__atomic_add_fetch(&t->rounds, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&t->forgetting, __ATOMIC_SEQ_CST)) {
+		futex(&t->rounds, FUTEX_WAKE_PRIVATE, INT_MAX);
 	}
-	fprintf(stderr, "No keyboard device found\n");
-	return 1;
 }
 
-static int check_keyboard_device_path(char* buff) {
-	int fd;
-	int rc;
-	struct libevdev* dev = NULL;
+// the ring is full: sleep until input_thread_drain made room, or a kick
+static void input_thread_wait_room(InputThread* t) {
+	__atomic_store_n(&t->full, true, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(transition_room(t) >= EVENT_BUFFER_SIZE + 1) {
+		__atomic_store_n(&t->full, false, __ATOMIC_RELAXED);
+		return;
+	}
+	struct pollfd p = { .fd = t->kick_fd, .events = POLLIN };
+	while(poll(&p, 1, -1) < 0 && errno == EINTR) {
+	}
+}
 
-	fd = open(buff, O_RDONLY | O_NONBLOCK);
-	if(fd == -1) {
-		// If no such file, device does not exist, skip
-		if (errno == ENOENT){
-			fprintf(stderr, "No keyboard device found\n");
+static void* input_thread_main(void* arg) {
+	InputThread* t = arg;
+	struct epoll_event events[MAX_KEYBOARDS + 1];
+	uint64_t count;
+
+	while(!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+		int n_events = epoll_wait(t->epoll_fd, events, MAX_KEYBOARDS + 1, -1);
+		if(n_events < 0 && errno != EINTR) {
+			perror("epoll_wait failed in the input thread");
+			break;
 		}
-		// Permission denied or other errors - skip but warn maybe
-		if (errno == EACCES || errno == EPERM) {
-			fprintf(stderr, "Permission denied opening %s, if this is your keyboard device, make sure to run the program with root access (sudo)\n", buff);
+		uint32_t tail = t->tail;
+		bool full = false;
+		for(int i = 0; i < n_events; i++) {
+			if(events[i].data.u64 == INPUT_KICK) {
+				if(read(t->kick_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+					perror("Error reading the input thread eventfd");
+				}
+			}
+			else if(!input_thread_read(t, events[i].data.u64)) {
+				full = true;
+			}
+		}
+		// one wakeup per round, however many reads it took
+		if(t->tail != tail) {
+			count = 1;
+			if(write(t->wake_fd, &count, sizeof(count)) < 0) {
+				perror("Failed to wake the main thread");
+			}
+		}
+		input_thread_end_round(t);
+		if(full) {
+			input_thread_wait_room(t);
 		}
-		perror("Error opening device");
-		return 1;
-	}
-	rc = libevdev_new_from_fd(fd, &dev);
-	if (rc < 0) {
-		close(fd);
-		fprintf(stderr, "Failed to init libevdev (%s)\n", strerror(-rc));
-		return 1;
 	}
-	if(libevdev_has_event_code(dev, EV_KEY, KEY_A) && libevdev_has_event_type(dev, EV_KEY) && libevdev_has_event_type(dev, EV_REP)) {
-		libevdev_free(dev);
-		close(fd);
-		return 0;
+	// nobody may wait on a reader that is gone, and the main thread has to notice
+	__atomic_store_n(&t->exited, true, __ATOMIC_SEQ_CST);
+	input_thread_end_round(t);
+	count = 1;
+	if(write(t->wake_fd, &count, sizeof(count)) < 0) {
+		perror("Failed to wake the main thread");
 	}
-	libevdev_free(dev);
-	close(fd);
-	fprintf(stderr, "Device provided does not look like a keyboard\n");
-	return 1;
+	return NULL;
 }
 
-int init_keyboard_fd(char* keyboard_path, size_t size) {
-	int err;
-	bool path_provided = (KEYBOARD_DEVICE[0] != '\0');
-
-	if(strlen(KEYBOARD_DEVICE) >= size) {
-		fprintf(stderr, "keyboard device path provided is too long.\n");
-		keyboard_path[0] = '\0';
-		return 1;
+static void input_thread_destroy(InputThread* t) {
+	if(t->epoll_fd >= 0) {
+		close(t->epoll_fd);
 	}
-
-	if(path_provided) {
-		strncpy(keyboard_path, KEYBOARD_DEVICE, size);
-		keyboard_path[size - 1] = '\0';
-		err = check_keyboard_device_path(keyboard_path);
-		if(err != 0){
-			fprintf(stderr, "Incorrect path provided in config.h, make sure its a keyboard device path\n");
-			return 1;
-		}
+	if(t->wake_fd >= 0) {
+		close(t->wake_fd);
 	}
-	else {
-		err = guess_keyboard_device_path(keyboard_path, size);
-		if(err != 0){
-			fprintf(stderr, "Error guessing keyboard device, please provide device path in config.h\n");
-			return 1;
-		}
+	if(t->kick_fd >= 0) {
+		close(t->kick_fd);
 	}
-	return 0;
+	free(t);
 }
 
-int init_mouse(Mouse* m, int uifd) {
-	m->key_states = calloc(KEY_MAX + 1, sizeof(int));
-	if(m->key_states == NULL) {
-		perror("error allocating key_states array");
-		return 1;
+static InputThread* input_thread_start(void) {
+	InputThread* t = aligned_alloc(64, sizeof(InputThread));
+	if(t == NULL) {
+		return NULL;
+	}
+	memset(t, 0, sizeof(*t));
+	t->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	t->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	t->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u64 = INPUT_KICK,
+	};
+	if(t->epoll_fd < 0 || t->wake_fd < 0 || t->kick_fd < 0 || epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, t->kick_fd, &ev) < 0) {
+		input_thread_destroy(t);
+		return NULL;
 	}
 
-	m->motion_speed = SPEED_NORMAL;
-	m->motion_fraction_x = 0;
-	m->motion_fraction_y = 0;
-
-	m->scroll_speed = SCROLL_SPEED_NORMAL;
-	m->scroll_fraction_x = 0;
-	m->scroll_fraction_y = 0;
-
-	m->click_tick = (struct timespec){0};
-	m->scroll_tick = (struct timespec){0};
-	m->motion_tick = (struct timespec){0};
-
-	m->button_left_pressed = false;
-	m->button_middle_pressed = false;
-	m->button_right_pressed = false;
-
-	m->uidev = create_uinput_mouse_dev(uifd);
-	if(m->uidev == NULL) {
-		perror("Error creating mouse device");
-		free(m->key_states);
-		return 1;
+	// the default 8 MiB stack would all be locked in realtime mode
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, INPUT_STACK_SIZE);
+	int err = pthread_create(&t->thread, &attr, input_thread_main, t);
+	pthread_attr_destroy(&attr);
+	if(err != 0) {
+		input_thread_destroy(t);
+		errno = err;
+		return NULL;
 	}
-	return 0;
+	return t;
 }
 
-void destroy_mouse(Mouse* m) {
-	libevdev_uinput_destroy(m->uidev);
-	free(m->key_states);
+static void input_thread_stop(InputThread* t) {
+	__atomic_store_n(&t->stop, true, __ATOMIC_RELEASE);
+	input_thread_kick(t);
+	pthread_join(t->thread, NULL);
+	stats.discarded += t->discarded;
+	input_thread_destroy(t);
 }
 
-static int grab_keyboard(int fd) {
-	int err = ioctl(fd, EVIOCGRAB, 1);
+static int input_thread_watch(InputThread* t, int fd, int slot) {
+	uint32_t gen = ++t->gen[slot] & 0xffffff;
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u64 = (uint64_t)gen << 40 | (uint64_t)slot << 32 | (uint32_t)fd,
+	};
+	int err = epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
 	if(err < 0) {
-		perror("Failed to grab input device");
+		perror("Failed to watch keyboard");
 	}
 	return err;
 }
 
-static int ungrab_keyboard(int fd) {
-	int err = ioctl(fd, EVIOCGRAB, 0);
-	if(err < 0) {
-		perror("Failed to ungrab input device");
+/*
+ * Before fd can be closed the reader must be done with it: a round that
+ * started before EPOLL_CTL_DEL may still read it, and after the close the
+ * number can belong to the next file opened. Kick the reader and sleep
+ * until its current round ended, it never waits on us in the middle of one.
+ */
+static void input_thread_forget(InputThread* t, int fd) {
+	epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	__atomic_store_n(&t->forgetting, true, __ATOMIC_SEQ_CST);
+	uint32_t rounds = __atomic_load_n(&t->rounds, __ATOMIC_SEQ_CST);
+	input_thread_kick(t);
+	while(__atomic_load_n(&t->rounds, __ATOMIC_ACQUIRE) == rounds && !__atomic_load_n(&t->exited, __ATOMIC_ACQUIRE)) {
+		// returns at once if rounds moved on in the meantime
+		futex(&t->rounds, FUTEX_WAIT_PRIVATE, rounds);
 	}
-	return err;
+	__atomic_store_n(&t->forgetting, false, __ATOMIC_RELAXED);
 }
-
-
-static bool are_keys_released(int fd) {
-	uint8_t keys[KEY_STATE_MAX];
-	if(ioctl(fd, EVIOCGKEY(sizeof(keys)), keys) < 0) {
-		perror("EVIOCGKEY failed");
+#endif
+
+/*
+ * Periodic deadline on a fixed grid: the next step is always previous
+ * deadline + period, so steps never accumulate drift. The first step fires
+ * right away. If we fell more than a period behind (suspend, stall) the grid
+ * is re-anchored instead of emitting a burst of catch-up steps.
+ */
+static bool tick_due(uint64_t* deadline, uint64_t period, uint64_t now) {
+	if(*deadline == 0) {
+		*deadline = now + period;
+		return true;
+	}
+	if(now < *deadline) {
 		return false;
 	}
-	for(int i = 0; i < KEY_STATE_MAX; i++) {
-		if(keys[i]) {
-			return false;
-		}
+	hist_add(&latency.tick_jitter, now - *deadline);
+	*deadline += period;
+	if(*deadline <= now) {
+		*deadline = now + period;
 	}
 	return true;
 }
 
+static bool motion_keys_held(Mouse* m) {
+	return m->actions & MOTION_ACTIONS;
+}
 
-static bool key_combo_pressed(int* key_states, const int* combo_keys, size_t n) {
-	for(size_t i = 0; i < n; i++) {
-		if(!key_states[combo_keys[i]]) {
-			return false;
-		}
+static bool scroll_keys_held(Mouse* m) {
+	return m->actions & SCROLL_ACTIONS;
+}
+
+static bool buttons_changed(Mouse* m) {
+	return (m->actions & BUTTON_ACTIONS) != m->buttons_pressed;
+}
+
+// the slowest held modifier wins, it has the lowest action bit
+static Tier speed_tier(Mouse* m) {
+	uint32_t held = m->actions & TIER_ACTIONS;
+	return held ? action_tiers[__builtin_ctz(held)] : m->base_tier;
+}
+
+// sum of the directions of the held actions in mask, opposite ones cancel
+static void held_direction(Mouse* m, uint32_t mask, int* x, int* y) {
+	*x = 0;
+	*y = 0;
+	for(uint32_t held = m->actions & mask; held != 0; held &= held - 1) {
+		int a = __builtin_ctz(held);
+		*x += action_directions[a].x;
+		*y += action_directions[a].y;
 	}
-	return true;
 }
 
-static void wait_grab_until_release(int keyboard_fd) {
-	int err;
-	while(1) {
-		err = grab_keyboard(keyboard_fd);
-		if(err < 0) {
-			perror("error grabbing keyboard");
-			usleep(1000);
-			continue;
-		}
-		if(are_keys_released(keyboard_fd)) {
-			break;
+/*
+ * Sample the acceleration curve, linearly interpolated between its points,
+ * into accel_lut so the motion tick only does an index lookup. A curve
+ * longer than the table at ACCEL_LUT_STEP_NS is sampled more coarsely, so
+ * its last point is always reached. Before the first point the speed stays
+ * at that point's value, as it does after the last one.
+ */
+static void build_accel_lut(Config* c) {
+	uint64_t last_ns = c->accel_curve[c->accel_curve_size - 1][0] * 1000000ULL;
+	c->accel_lut_step_ns = MAX(ACCEL_LUT_STEP_NS, (last_ns + ACCEL_LUT_SIZE - 2) / (ACCEL_LUT_SIZE - 1));
+	c->accel_lut_size = (last_ns + c->accel_lut_step_ns - 1) / c->accel_lut_step_ns + 1;
+
+	size_t seg = 0;
+	for(size_t i = 0; i < c->accel_lut_size; i++) {
+		double t = i * c->accel_lut_step_ns / 1e6;
+		while(seg + 1 < c->accel_curve_size && c->accel_curve[seg + 1][0] <= t) {
+			seg++;
 		}
-		err = ungrab_keyboard(keyboard_fd);
-		if(err < 0) {
-			perror("error ungrabbing keyboard");
-			usleep(1000);
-			continue;
+		double percent = c->accel_curve[seg][1];
+		if(seg + 1 < c->accel_curve_size && t >= c->accel_curve[seg][0]) {
+			double t0 = c->accel_curve[seg][0];
+			double t1 = c->accel_curve[seg + 1][0];
+			double p1 = c->accel_curve[seg + 1][1];
+			percent += (p1 - percent) * (t - t0) / (t1 - t0);
 		}
-		usleep(1000);
+		percent = MIN(MAX(percent, 0.0), MAX_ACCEL_PERCENT);
+		c->accel_lut[i] = (uint32_t)(percent / 100.0 * FIXED_ONE);
 	}
 }
 
-static void process_event(struct input_event* event, Mouse* m, bool* grabbing, bool* quit, int keyboard_fd) {
-	if(event->type != EV_KEY || event->code >= KEY_MAX) {
-		return;
-	}
-	int code = event->code;
-	int value = event->value;
+static uint32_t accel_factor(uint64_t held_ns) {
+	uint64_t i = held_ns / config->accel_lut_step_ns;
+	return config->accel_lut[MIN(i, config->accel_lut_size - 1)];
+}
 
-	m->key_states[code] = value;
+// motion ticks only run while a motion key is held, so a high rate costs nothing idle
+static uint64_t motion_period_ns(void) {
+	return 1000000000ULL / config->motion_rate_hz;
+}
 
+// returns true when pixels were emitted
+static bool handle_motion(Mouse* m, uint64_t now) {
+	int x;
+	int y;
+	held_direction(m, MOTION_ACTIONS, &x, &y);
 
-	if(!(*grabbing) && key_combo_pressed(m->key_states, start_combo_keys, start_combo_keys_size)) {
-		*grabbing = true;
-		wait_grab_until_release(keyboard_fd);
-		memset(m->key_states, 0, sizeof(int) * KEY_MAX);
+	// the first step covers one nominal period, later ones the measured dt
+	uint64_t dt = motion_period_ns();
+	if(m->motion_start == 0) {
+		m->motion_start = now;
+	}
+	else {
+		dt = MIN(now - m->motion_last, MOTION_MAX_DT_NS);
+	}
+	m->motion_last = now;
+	if(x == 0 && y == 0) return false;
+	
+	m->motion_speed = config->motion_speeds[speed_tier(m)];
+
+	// px/s, scaled by how long the movement has been held
+	int64_t velocity = ((int64_t) m->motion_speed * accel_factor(now - m->motion_start)) >> FIXED_SHIFT;
+	// distance in 16.16 pixels over dt, whole ms and the rest apart so it can't overflow
+	int64_t distance = velocity * FIXED_ONE * (int64_t)(dt / 1000000) / 1000
+		+ velocity * FIXED_ONE * (int64_t)(dt % 1000000) / 1000000000LL;
+	// keep diagonal speed equal to straight speed
+	if(x != 0 && y != 0) {
+		distance = distance * FIXED_SQRT1_2 >> FIXED_SHIFT;
 	}
 
-	if(*grabbing) {
-		if(key_combo_pressed(m->key_states, exit_combo_keys, exit_combo_keys_size)) {
-			memset(m->key_states, 0, sizeof(int) * KEY_MAX);
-			*grabbing = false;
-			ungrab_keyboard(keyboard_fd);
-		}
-		else if(key_combo_pressed(m->key_states, kill_combo_keys, kill_combo_keys_size)) {
-			*quit = true;
-			ungrab_keyboard(keyboard_fd);
-		}
+	// accumulate movement less than a pixel
+	m->motion_remainder_x += x * distance;
+	m->motion_remainder_y += y * distance;
+	int x_pixels = (int)(m->motion_remainder_x / FIXED_ONE);
+	int y_pixels = (int)(m->motion_remainder_y / FIXED_ONE);
+	m->motion_remainder_x -= (int64_t) x_pixels * FIXED_ONE;
+	m->motion_remainder_y -= (int64_t) y_pixels * FIXED_ONE;
+
+	if(x_pixels != 0) {
+		frame_add(&m->frame, EV_REL, REL_X, x_pixels);
+	}
+	if(y_pixels != 0) {
+		frame_add(&m->frame, EV_REL, REL_Y, y_pixels);
 	}
+	m->pos_x = MIN(MAX(m->pos_x + x_pixels, 0), config->screen_width - 1);
+	m->pos_y = MIN(MAX(m->pos_y + y_pixels, 0), config->screen_height - 1);
+	return x_pixels != 0 || y_pixels != 0;
 }
 
+// hi-res output runs at the motion rate, whole notches at their own
+static uint64_t scroll_period_ns(void) {
+	return config->scroll_hi_res ? motion_period_ns() : config->scroll_delay_ms * 1000000ULL;
+}
 
-static void run_event_loop(int keyboard_fd, Mouse* mouse) {
-	bool quit = false;
-	bool grabbing = false;
-
-	struct pollfd fds[1];
-	fds[0].events = POLLIN;
-	fds[0].fd = keyboard_fd;
-	int poll_result;
+// kinetic scrolling still going after the keys were released
+static bool scroll_coasting(Mouse* m) {
+	return config->scroll_kinetic_ms > 0 && (m->scroll_velocity_x != 0 || m->scroll_velocity_y != 0);
+}
 
-	struct input_event event;
-	ssize_t bytes_read;
+// a held key sets the velocity, without one it decays until it stops
+static float scroll_velocity(float velocity, int direction, int speed, float decay) {
+	if(direction != 0) {
+		return direction * speed;
+	}
+	velocity *= decay;
+	return (velocity > -SCROLL_MIN_VELOCITY && velocity < SCROLL_MIN_VELOCITY) ? 0 : velocity;
+}
 
-	while(!quit) {
-		poll_result = poll(fds, 1, POLL_DELAY_MS);
-		if(poll_result > 0) {
-			bytes_read = read(keyboard_fd, &event, sizeof(event));
-			if(bytes_read == (ssize_t)sizeof(event)) {
-				process_event(&event, mouse, &grabbing, &quit, keyboard_fd);
-			} 
-			else if(errno != EAGAIN && errno != EWOULDBLOCK) {
-					perror("Error reading event");
-					quit = true;
-					break;
-			}
-		}
-		else if(poll_result < 0) {
-			perror("poll failed");
-			quit = true;
-			break;
-		}
-		if(grabbing) {
-			handle_mouse(mouse);
-		}
+// hi-res units go out as they come, the legacy notch whenever 120 of them add up
+static void emit_wheel(Mouse* m, int code, int hi_res_code, int units, int* notch_units) {
+	if(units == 0) {
+		return;
+	}
+	frame_add(&m->frame, EV_REL, hi_res_code, units);
+	*notch_units += units;
+	int notches = *notch_units / WHEEL_UNITS_PER_NOTCH;
+	if(notches != 0) {
+		frame_add(&m->frame, EV_REL, code, notches);
+		*notch_units -= notches * WHEEL_UNITS_PER_NOTCH;
 	}
 }
 
+/*
+ * Scroll in REL_WHEEL_HI_RES/REL_HWHEEL_HI_RES units, 120 per notch, with
+ * REL_WHEEL/REL_HWHEEL following for clients that only read notches. With
+ * scroll_hi_res off both only ever move by whole notches.
+ */
+static void handle_scroll(Mouse* m, uint64_t period) {
+	int x;
+	int y;
+	held_direction(m, SCROLL_ACTIONS, &x, &y);
+
+	m->scroll_speed = config->scroll_speeds[speed_tier(m)];
+
+	// exp(-t / scroll_kinetic_ms) per tick, 0 without kinetic scrolling
+	float decay = config->scroll_kinetic_ms > 0 ? expf(-(period / 1e6f) / config->scroll_kinetic_ms) : 0;
+	m->scroll_velocity_x = scroll_velocity(m->scroll_velocity_x, x, m->scroll_speed, decay);
+	m->scroll_velocity_y = scroll_velocity(m->scroll_velocity_y, y, m->scroll_speed, decay);
+
+	// store small scroll deltas, send them once a whole step is reached
+	float units_per_notch = period / 1e9f * WHEEL_UNITS_PER_NOTCH;
+	int step = config->scroll_hi_res ? 1 : WHEEL_UNITS_PER_NOTCH;
+	m->scroll_fraction_x += m->scroll_velocity_x * units_per_notch;
+	m->scroll_fraction_y += m->scroll_velocity_y * units_per_notch;
+	int x_units = (int)(m->scroll_fraction_x / step) * step;
+	int y_units = (int)(m->scroll_fraction_y / step) * step;
+	m->scroll_fraction_x -= x_units;
+	m->scroll_fraction_y -= y_units;
+
+	emit_wheel(m, REL_HWHEEL, REL_HWHEEL_HI_RES, x_units, &m->scroll_notch_x);
+	emit_wheel(m, REL_WHEEL, REL_WHEEL_HI_RES, y_units, &m->scroll_notch_y);
+}
 
-int main() {
-	int keyboard_fd;
-	int mouse_uifd;
-	char keyboard_path[MAX_DEVICE_PATH_SIZE];
-	Mouse mouse;
-	
-	if(init_keyboard_fd(keyboard_path, sizeof keyboard_path) != 0){
-		return 1;
+// send every button whose held state differs from what was sent last
+static void handle_click(Mouse* m) {
+	uint32_t held = m->actions & BUTTON_ACTIONS;
+	for(uint32_t changed = held ^ m->buttons_pressed; changed != 0; changed &= changed - 1) {
+		int a = __builtin_ctz(changed);
+		frame_add(&m->frame, EV_KEY, action_buttons[a], (held >> a) & 1);
 	}
+	m->buttons_pressed = held;
+}
 
-	keyboard_fd = open(keyboard_path, O_RDONLY | O_NONBLOCK);
-	if(keyboard_fd < 0) {
-		perror("Error opening input device");
-		return 1;
+
+static void handle_mouse(Mouse* m, uint64_t now) {
+	// click_deadline is the earliest time the next button change may go out
+	bool clicked = false;
+	bool ticked = false;
+	if(!buttons_changed(m)) {
+		m->click_key_time = 0;
 	}
-	
-	mouse_uifd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
-	if(mouse_uifd < 0) {
-		perror("Failed to open /dev/uinput. Is the uinput module loaded?");
-		close(keyboard_fd);
-		return 1;
+	else if(now >= m->click_deadline) {
+		handle_click(m);
+		m->click_deadline = now + config->click_delay_ms * 1000000ULL;
+		clicked = true;
+	}
+
+	if(!scroll_keys_held(m) && !scroll_coasting(m)) {
+		m->scroll_deadline = 0;
+		m->scroll_velocity_x = 0;
+		m->scroll_velocity_y = 0;
+	}
+	else if(tick_due(&m->scroll_deadline, scroll_period_ns(), now)) {
+		handle_scroll(m, scroll_period_ns());
+		ticked = true;
+	}
+
+	bool moved = false;
+	// in grid mode the motion keys jump instead
+	if(!motion_keys_held(m) || m->grid_active) {
+		m->motion_deadline = 0;
+		m->motion_start = 0;
+		m->motion_key_time = 0;
+	}
+	else if(tick_due(&m->motion_deadline, motion_period_ns(), now)) {
+		moved = handle_motion(m, now);
+		ticked = true;
+	}
+
+	// e.g. motion below a pixel: the wakeup was for nothing
+	if(ticked && m->frame.count == 0) {
+		stats.empty_ticks++;
+	}
+	// buttons, wheel and motion of this tick go out as one report
+	frame_flush(&m->frame, m->uifd);
+
+	if(clicked && m->click_key_time != 0) {
+		hist_add(&latency.key_to_click, now - MIN(now, m->click_key_time));
+		m->click_key_time = 0;
+	}
+	if(moved && m->motion_key_time != 0) {
+		hist_add(&latency.key_to_motion, now - MIN(now, m->motion_key_time));
+		m->motion_key_time = 0;
+	}
+}
+
+// earliest pending deadline, 0 when nothing is held and the loop may sleep
+static uint64_t next_deadline(Mouse* m) {
+	uint64_t next = 0;
+	if(buttons_changed(m)) {
+		next = m->click_deadline;
+	}
+	if(m->scroll_deadline != 0 && (next == 0 || m->scroll_deadline < next)) {
+		next = m->scroll_deadline;
+	}
+	if(m->motion_deadline != 0 && (next == 0 || m->motion_deadline < next)) {
+		next = m->motion_deadline;
+	}
+	return next;
+}
+
+
+static bool test_bit(const unsigned long* bits, int bit) {
+	return (bits[bit / BITS_PER_LONG] >> (bit % BITS_PER_LONG)) & 1;
+}
+
+static void set_bit(unsigned long* bits, int bit) {
+	bits[bit / BITS_PER_LONG] |= 1UL << (bit % BITS_PER_LONG);
+}
+
+static void clear_bit(unsigned long* bits, int bit) {
+	bits[bit / BITS_PER_LONG] &= ~(1UL << (bit % BITS_PER_LONG));
+}
+
+static void compile_combo(Combo* combo) {
+	memset(combo->mask, 0, sizeof(combo->mask));
+	for(size_t i = 0; i < combo->size; i++) {
+		set_bit(combo->mask, combo->keys[i]);
+	}
+}
+
+static void set_combo(Combo* combo, const int* keys, size_t n) {
+	combo->size = MIN(n, MAX_COMBO_KEYS);
+	memcpy(combo->keys, keys, combo->size * sizeof(int));
+	compile_combo(combo);
+}
+
+// every key of the combo is held, whatever else is
+static bool combo_pressed(const unsigned long* keys, const Combo* combo) {
+	for(size_t i = 0; i < KEY_WORDS; i++) {
+		if((keys[i] & combo->mask[i]) != combo->mask[i]) {
+			return false;
+		}
+	}
+	return combo->size > 0;
+}
+
+static void build_bound_keys(Config* c) {
+	memset(c->bound_keys, 0, sizeof(c->bound_keys));
+	for(int layer = 0; layer < MAX_LAYERS; layer++) {
+		for(int code = 0; code < KEY_CNT; code++) {
+			if(c->keymap[layer][code] != ACTION_NONE && c->keymap[layer][code] != ACTION_INHERIT) {
+				set_bit(c->bound_keys, code);
+			}
+		}
+	}
+}
+
+// the compiled-in settings from config.h
+static void config_defaults(Config* c) {
+	static const int start_combo_keys[] = START_COMBO_KEYS;
+	static const int exit_combo_keys[] = EXIT_COMBO_KEYS;
+	static const int kill_combo_keys[] = KILL_COMBO_KEYS;
+	static const int accel_curve[][2] = MOTION_ACCEL_CURVE;
+
+	memset(c, 0, sizeof(*c));
+	memset(c->keymap[1], ACTION_INHERIT, sizeof(c->keymap) - sizeof(c->keymap[0]));
+	uint8_t* base = c->keymap[0];
+	base[K_UP] = ACTION_UP;
+	base[K_DOWN] = ACTION_DOWN;
+	base[K_LEFT] = ACTION_LEFT;
+	base[K_RIGHT] = ACTION_RIGHT;
+	base[K_BUTTON_LEFT] = ACTION_BUTTON_LEFT;
+	base[K_BUTTON_MIDDLE] = ACTION_BUTTON_MIDDLE;
+	base[K_BUTTON_RIGHT] = ACTION_BUTTON_RIGHT;
+	base[K_BUTTON_SIDE] = ACTION_BUTTON_SIDE;
+	base[K_BUTTON_EXTRA] = ACTION_BUTTON_EXTRA;
+	base[K_SCROLL_UP] = ACTION_SCROLL_UP;
+	base[K_SCROLL_DOWN] = ACTION_SCROLL_DOWN;
+	base[K_SCROLL_LEFT] = ACTION_SCROLL_LEFT;
+	base[K_SCROLL_RIGHT] = ACTION_SCROLL_RIGHT;
+	base[SLOWER_MOD] = ACTION_SLOWER;
+	base[SLOW_MOD] = ACTION_SLOW;
+	base[FAST_MOD] = ACTION_FAST;
+	base[K_GRID] = ACTION_GRID;
+	base[K_MARK] = ACTION_MARK;
+	base[K_RECALL] = ACTION_RECALL;
+	// a key set to 0 in config.h is unbound
+	base[KEY_RESERVED] = ACTION_NONE;
+
+	c->motion_speeds[TIER_SLOWER] = SPEED_SLOWER;
+	c->motion_speeds[TIER_SLOW] = SPEED_SLOW;
+	c->motion_speeds[TIER_NORMAL] = SPEED_NORMAL;
+	c->motion_speeds[TIER_FAST] = SPEED_FAST;
+	c->scroll_speeds[TIER_SLOWER] = SCROLL_SPEED_SLOWER;
+	c->scroll_speeds[TIER_SLOW] = SCROLL_SPEED_SLOW;
+	c->scroll_speeds[TIER_NORMAL] = SCROLL_SPEED_NORMAL;
+	c->scroll_speeds[TIER_FAST] = SCROLL_SPEED_FAST;
+
+	c->click_delay_ms = CLICK_DELAY_MS;
+	c->scroll_delay_ms = SCROLL_DELAY_MS;
+	c->scroll_hi_res = SCROLL_HI_RES;
+	c->scroll_kinetic_ms = SCROLL_KINETIC_MS;
+	c->motion_rate_hz = MIN(MAX(MOTION_RATE_HZ, 1), MAX_MOTION_RATE_HZ);
+	c->screen_width = MIN(MAX(SCREEN_WIDTH, 1), MAX_SCREEN_SIZE);
+	c->screen_height = MIN(MAX(SCREEN_HEIGHT, 1), MAX_SCREEN_SIZE);
+
+	set_combo(&c->start_combo, start_combo_keys, sizeof(start_combo_keys) / sizeof(start_combo_keys[0]));
+	set_combo(&c->exit_combo, exit_combo_keys, sizeof(exit_combo_keys) / sizeof(exit_combo_keys[0]));
+	set_combo(&c->kill_combo, kill_combo_keys, sizeof(kill_combo_keys) / sizeof(kill_combo_keys[0]));
+
+	c->accel_curve_size = MIN(sizeof(accel_curve) / sizeof(accel_curve[0]), MAX_ACCEL_POINTS);
+	memcpy(c->accel_curve, accel_curve, c->accel_curve_size * sizeof(accel_curve[0]));
+}
+
+// KEY_*/BTN_* name or a raw keycode, -1 if neither
+static int parse_key(const char* name) {
+	int code = libevdev_event_code_from_name(EV_KEY, name);
+	if(code < 0) {
+		char* end;
+		long value = strtol(name, &end, 0);
+		if(*end == '\0' && end != name) {
+			code = (int) value;
+		}
+	}
+	return (code > 0 && code < KEY_CNT) ? code : -1;
+}
+
+static int parse_action(const char* name) {
+	for(int a = 0; a < ACTION_COUNT; a++) {
+		if(strcmp(action_names[a], name) == 0) {
+			return a;
+		}
+	}
+	return -1;
+}
+
+static int parse_combo(Combo* combo, char** args, size_t n) {
+	if(n == 0 || n > MAX_COMBO_KEYS) {
+		return -1;
+	}
+	for(size_t i = 0; i < n; i++) {
+		int code = parse_key(args[i]);
+		if(code < 0) {
+			return -1;
+		}
+		combo->keys[i] = code;
+	}
+	combo->size = n;
+	compile_combo(combo);
+	return 0;
+}
+
+// "ms:percent" points in increasing time order, see build_accel_lut for before the first
+static int parse_accel(Config* c, char** args, size_t n) {
+	if(n == 0 || n > MAX_ACCEL_POINTS) {
+		return -1;
+	}
+	for(size_t i = 0; i < n; i++) {
+		int ms, percent;
+		if(sscanf(args[i], "%d:%d", &ms, &percent) != 2 || ms < 0 || percent < 0 || percent > MAX_ACCEL_PERCENT
+			|| (i > 0 && ms <= c->accel_curve[i - 1][0])) {
+			return -1;
+		}
+		c->accel_curve[i][0] = ms;
+		c->accel_curve[i][1] = percent;
+	}
+	c->accel_curve_size = n;
+	return 0;
+}
+
+typedef struct {
+	const char* name;
+	size_t offset;
+	int min;
+	int max;
+} IntOption;
+
+static const IntOption int_options[] = {
+	{ "speed_slower", offsetof(Config, motion_speeds[TIER_SLOWER]), 0, MAX_SPEED },
+	{ "speed_slow", offsetof(Config, motion_speeds[TIER_SLOW]), 0, MAX_SPEED },
+	{ "speed_normal", offsetof(Config, motion_speeds[TIER_NORMAL]), 0, MAX_SPEED },
+	{ "speed_fast", offsetof(Config, motion_speeds[TIER_FAST]), 0, MAX_SPEED },
+	{ "scroll_speed_slower", offsetof(Config, scroll_speeds[TIER_SLOWER]), 0, MAX_SPEED },
+	{ "scroll_speed_slow", offsetof(Config, scroll_speeds[TIER_SLOW]), 0, MAX_SPEED },
+	{ "scroll_speed_normal", offsetof(Config, scroll_speeds[TIER_NORMAL]), 0, MAX_SPEED },
+	{ "scroll_speed_fast", offsetof(Config, scroll_speeds[TIER_FAST]), 0, MAX_SPEED },
+	{ "click_delay_ms", offsetof(Config, click_delay_ms), 0, INT_MAX },
+	{ "scroll_delay_ms", offsetof(Config, scroll_delay_ms), 1, INT_MAX },
+	{ "scroll_hi_res", offsetof(Config, scroll_hi_res), 0, INT_MAX },
+	{ "scroll_kinetic_ms", offsetof(Config, scroll_kinetic_ms), 0, INT_MAX },
+	{ "motion_rate_hz", offsetof(Config, motion_rate_hz), 1, MAX_MOTION_RATE_HZ },
+	{ "screen_width", offsetof(Config, screen_width), 1, MAX_SCREEN_SIZE },
+	{ "screen_height", offsetof(Config, screen_height), 1, MAX_SCREEN_SIZE },
+};
+
+/*
+ * One config line: "option args...". Blank lines and lines starting with #
+ * are ignored. Returns 0 on success, -1 on a malformed line.
+ */
+static int parse_config_line(Config* c, char* line) {
+	char* args[MAX_COMBO_KEYS + MAX_ACCEL_POINTS + 1];
+	size_t n = 0;
+	char* save;
+
+	for(char* tok = strtok_r(line, " \t\r\n", &save); tok != NULL; tok = strtok_r(NULL, " \t\r\n", &save)) {
+		if(tok[0] == '#') {
+			break;
+		}
+		if(n == sizeof(args) / sizeof(args[0])) {
+			return -1;
+		}
+		args[n++] = tok;
+	}
+	if(n == 0) {
+		return 0;
+	}
+
+	const char* option = args[0];
+	if(strcmp(option, "bind") == 0) {
+		int code = n == 3 ? parse_key(args[1]) : -1;
+		int action = n == 3 ? parse_action(args[2]) : -1;
+		if(code < 0 || action < 0) {
+			return -1;
+		}
+		c->keymap[c->bind_layer][code] = action;
+		return 0;
+	}
+	if(strcmp(option, "unbind_all") == 0 && n == 1) {
+		memset(c->keymap[c->bind_layer], ACTION_NONE, sizeof(c->keymap[0]));
+		return 0;
+	}
+	if(strcmp(option, "layer") == 0) {
+		char* end;
+		long layer = n == 2 ? strtol(args[1], &end, 10) : -1;
+		if(n != 2 || *end != '\0' || layer < 0 || layer >= MAX_LAYERS) {
+			return -1;
+		}
+		c->bind_layer = layer;
+		return 0;
+	}
+	if(strcmp(option, "start_combo") == 0) return parse_combo(&c->start_combo, args + 1, n - 1);
+	if(strcmp(option, "exit_combo") == 0) return parse_combo(&c->exit_combo, args + 1, n - 1);
+	if(strcmp(option, "kill_combo") == 0) return parse_combo(&c->kill_combo, args + 1, n - 1);
+	if(strcmp(option, "accel") == 0) return parse_accel(c, args + 1, n - 1);
+
+	for(size_t i = 0; i < sizeof(int_options) / sizeof(int_options[0]); i++) {
+		if(strcmp(option, int_options[i].name) == 0) {
+			char* end;
+			long value = n == 2 ? strtol(args[1], &end, 10) : -1;
+			if(n != 2 || *end != '\0' || value < int_options[i].min || value > int_options[i].max) {
+				return -1;
+			}
+			*(int*)((char*) c + int_options[i].offset) = (int) value;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Build a config from the config.h defaults and the file at path, if there
+ * is one. A missing file is not an error. Returns NULL on a malformed file.
+ */
+static Config* load_config(const char* path) {
+	char line[MAX_CONFIG_LINE];
+	int lineno = 0;
+	int err = 0;
+
+	Config* c = malloc(sizeof(Config));
+	if(c == NULL) {
+		perror("error allocating config");
+		return NULL;
+	}
+	config_defaults(c);
+
+	FILE* f = (path != NULL && path[0] != '\0') ? fopen(path, "re") : NULL;
+	if(f == NULL && path != NULL && path[0] != '\0' && errno != ENOENT) {
+		perror(path);
+		err = 1;
+	}
+	while(f != NULL && fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		if(parse_config_line(c, line) != 0) {
+			fprintf(stderr, "%s:%d: invalid line\n", path, lineno);
+			err = 1;
+		}
+	}
+	if(f != NULL) {
+		fclose(f);
+	}
+	if(err) {
+		free(c);
+		return NULL;
+	}
+	c->bind_layer = 0;
+	build_accel_lut(c);
+	build_bound_keys(c);
+	return c;
+}
+
+// CONFIG_FILE, or $XDG_CONFIG_HOME/mouse_move/config, or ~/.config/mouse_move/config
+static void default_config_path(char* buff, size_t size) {
+	const char* xdg = getenv("XDG_CONFIG_HOME");
+	const char* home = getenv("HOME");
+	if(CONFIG_FILE[0] != '\0') {
+		snprintf(buff, size, "%s", CONFIG_FILE);
+	}
+	else if(xdg != NULL && xdg[0] != '\0') {
+		snprintf(buff, size, "%s/mouse_move/config", xdg);
+	}
+	else if(home != NULL && home[0] != '\0') {
+		snprintf(buff, size, "%s/.config/mouse_move/config", home);
+	}
+	else {
+		buff[0] = '\0';
+	}
+}
+
+
+static struct libevdev_uinput* create_uinput_mouse_dev(int uifd) {
+	struct libevdev_uinput* ui_mouse_dev;
+	struct libevdev* mouse_dev;
+	int err;
+
+	mouse_dev = libevdev_new();
+	if(mouse_dev == NULL) {
+		perror("Error creating virtual mouse device");
+		return NULL;
+	}
+	libevdev_set_name(mouse_dev, "virtual mouse");
+	libevdev_enable_event_type(mouse_dev, EV_REL);
+	libevdev_enable_event_code(mouse_dev, EV_REL, REL_X, NULL);
+	libevdev_enable_event_code(mouse_dev, EV_REL, REL_Y, NULL);
+	libevdev_enable_event_code(mouse_dev, EV_REL, REL_WHEEL, NULL);
+	libevdev_enable_event_code(mouse_dev, EV_REL, REL_HWHEEL, NULL);
+	libevdev_enable_event_code(mouse_dev, EV_REL, REL_WHEEL_HI_RES, NULL);
+	libevdev_enable_event_code(mouse_dev, EV_REL, REL_HWHEEL_HI_RES, NULL);
+
+	libevdev_enable_event_type(mouse_dev, EV_KEY);
+	libevdev_enable_event_code(mouse_dev, EV_KEY, BTN_LEFT, NULL);
+	libevdev_enable_event_code(mouse_dev, EV_KEY, BTN_MIDDLE, NULL);
+	libevdev_enable_event_code(mouse_dev, EV_KEY, BTN_RIGHT, NULL);
+	libevdev_enable_event_code(mouse_dev, EV_KEY, BTN_SIDE, NULL);
+	libevdev_enable_event_code(mouse_dev, EV_KEY, BTN_EXTRA, NULL);
+
+	err = libevdev_uinput_create_from_device(mouse_dev, uifd, &ui_mouse_dev);
+	if(err != 0) {
+		perror("Error creating uinput mouse device");
+		libevdev_free(mouse_dev);
+		return NULL;
+	}
+	libevdev_free(mouse_dev);
+	return ui_mouse_dev;
+}
+
+/*
+ * Absolute pointer for jumps, next to the relative one. ABS_X/ABS_Y span
+ * the configured screen, and BTN_LEFT makes udev take it for an
+ * absolute mouse, like a VM tablet, rather than a touchscreen.
+ */
+static struct libevdev_uinput* create_uinput_abs_dev(void) {
+	struct libevdev_uinput* ui_abs_dev;
+	struct libevdev* abs_dev;
+	struct input_absinfo abs_x = { .maximum = config->screen_width - 1 };
+	struct input_absinfo abs_y = { .maximum = config->screen_height - 1 };
+	int err;
+
+	abs_dev = libevdev_new();
+	if(abs_dev == NULL) {
+		perror("Error creating virtual absolute mouse device");
+		return NULL;
+	}
+	libevdev_set_name(abs_dev, "virtual mouse absolute");
+	libevdev_enable_event_type(abs_dev, EV_ABS);
+	libevdev_enable_event_code(abs_dev, EV_ABS, ABS_X, &abs_x);
+	libevdev_enable_event_code(abs_dev, EV_ABS, ABS_Y, &abs_y);
+	libevdev_enable_event_type(abs_dev, EV_KEY);
+	libevdev_enable_event_code(abs_dev, EV_KEY, BTN_LEFT, NULL);
+
+	err = libevdev_uinput_create_from_device(abs_dev, LIBEVDEV_UINPUT_OPEN_MANAGED, &ui_abs_dev);
+	if(err != 0) {
+		errno = -err;
+		perror("Error creating uinput absolute mouse device");
+		libevdev_free(abs_dev);
+		return NULL;
+	}
+	libevdev_free(abs_dev);
+	return ui_abs_dev;
+}
+
+// keyboard keys only, the BTN_* ranges would make udev take the device for a mouse or joystick
+static bool is_keyboard_key(int code) {
+	return (code > KEY_RESERVED && code < BTN_MISC)
+		|| (code >= KEY_OK && code < BTN_DPAD_UP)
+		|| (code >= KEY_ALS_TOGGLE && code < BTN_TRIGGER_HAPPY);
+}
+
+static struct libevdev_uinput* create_uinput_keyboard_dev(void) {
+	struct libevdev_uinput* ui_kbd_dev;
+	struct libevdev* kbd_dev;
+	int err;
+
+	kbd_dev = libevdev_new();
+	if(kbd_dev == NULL) {
+		perror("Error creating virtual keyboard device");
+		return NULL;
+	}
+	libevdev_set_name(kbd_dev, "virtual keyboard");
+	libevdev_enable_event_type(kbd_dev, EV_KEY);
+	for(int code = 0; code < KEY_CNT; code++) {
+		if(is_keyboard_key(code)) {
+			libevdev_enable_event_code(kbd_dev, EV_KEY, code, NULL);
+		}
+	}
+
+	err = libevdev_uinput_create_from_device(kbd_dev, LIBEVDEV_UINPUT_OPEN_MANAGED, &ui_kbd_dev);
+	if(err != 0) {
+		errno = -err;
+		perror("Error creating uinput keyboard device");
+		libevdev_free(kbd_dev);
+		return NULL;
+	}
+	libevdev_free(kbd_dev);
+	return ui_kbd_dev;
+}
+
+/*
+ * Read a capability bitmap of an input device from sysfs, which is a list
+ * of space separated hex longs, most significant first. This needs no open()
+ * of the device node, so sleeping USB/Bluetooth devices are left alone.
+ */
+static int read_capabilities(const char* event_name, const char* cap, unsigned long* bits, size_t n_longs) {
+	char path[PATH_MAX];
+	char line[1024];
+	unsigned long words[NLONGS(KEY_CNT)];
+	size_t n_words = 0;
+
+	snprintf(path, sizeof(path), SYSFS_INPUT_DIR "/%s/device/capabilities/%s", event_name, cap);
+	FILE* f = fopen(path, "re");
+	if(f == NULL) {
+		return -1;
+	}
+	char* res = fgets(line, sizeof(line), f);
+	fclose(f);
+	if(res == NULL) {
+		return -1;
+	}
+
+	char* ptr = line;
+	char* end;
+	while(n_words < NLONGS(KEY_CNT)) {
+		unsigned long word = strtoul(ptr, &end, 16);
+		if(end == ptr) {
+			break;
+		}
+		words[n_words++] = word;
+		ptr = end;
+	}
+
+	memset(bits, 0, n_longs * sizeof(long));
+	for(size_t i = 0; i < n_words && i < n_longs; i++) {
+		bits[i] = words[n_words - 1 - i];
+	}
+	return 0;
+}
+
+/*
+ * How many of the configured keys the device can produce, -1 if it does not
+ * look like a keyboard or can't produce the start combo. This ranks real
+ * keyboards above power buttons and hotkey devices that also report EV_KEY.
+ * Auto-detection also wants autorepeat (EV_REP), a device named with -d or
+ * KEYBOARD_DEVICE only has to produce the start combo.
+ */
+static int keyboard_score(const char* event_name) {
+	unsigned long ev_bits[NLONGS(EV_CNT)];
+	unsigned long key_bits[NLONGS(KEY_CNT)];
+
+	if(read_capabilities(event_name, "ev", ev_bits, NLONGS(EV_CNT)) != 0
+		|| read_capabilities(event_name, "key", key_bits, NLONGS(KEY_CNT)) != 0) {
+		return -1;
+	}
+	if(!test_bit(ev_bits, EV_KEY) || (!test_bit(ev_bits, EV_REP) && keyboard_device[0] == '\0')) {
+		return -1;
+	}
+	for(size_t i = 0; i < config->start_combo.size; i++) {
+		if(!test_bit(key_bits, config->start_combo.keys[i])) {
+			return -1;
+		}
+	}
+
+	int score = 0;
+	for(size_t i = 0; i < KEY_WORDS; i++) {
+		score += __builtin_popcountl(config->bound_keys[i] & key_bits[i]);
+	}
+	return score;
+}
+
+static int read_sysfs_line(const char* event_name, const char* attr, char* buff, size_t size) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), SYSFS_INPUT_DIR "/%s/device/%s", event_name, attr);
+	FILE* f = fopen(path, "re");
+	if(f == NULL) {
+		return -1;
+	}
+	char* res = fgets(buff, size, f);
+	fclose(f);
+	if(res == NULL) {
+		return -1;
+	}
+	buff[strcspn(buff, "\n")] = '\0';
+	return 0;
+}
+
+// what identifies a keyboard across a replug, when its event number may change
+static void device_identity(const char* event_name, char* buff, size_t size) {
+	char bus[16], vendor[16], product[16], name[DEVICE_ID_SIZE - 16];
+	if(read_sysfs_line(event_name, "id/bustype", bus, sizeof(bus)) != 0
+		|| read_sysfs_line(event_name, "id/vendor", vendor, sizeof(vendor)) != 0
+		|| read_sysfs_line(event_name, "id/product", product, sizeof(product)) != 0
+		|| read_sysfs_line(event_name, "name", name, sizeof(name)) != 0) {
+		buff[0] = '\0';
+		return;
+	}
+	snprintf(buff, size, "%.4s:%.4s:%.4s %s", bus, vendor, product, name);
+}
+
+static Keyboard* find_keyboard(Keyboards* k, const char* path) {
+	for(int i = 0; i < MAX_KEYBOARDS; i++) {
+		if(k->devices[i].fd >= 0 && strcmp(k->devices[i].path, path) == 0) {
+			return &k->devices[i];
+		}
+	}
+	return NULL;
+}
+
+// open path and take a free slot, returns the slot or -1
+static int add_keyboard(Keyboards* k, const char* path) {
+	int slot = -1;
+	for(int i = 0; i < MAX_KEYBOARDS; i++) {
+		if(k->devices[i].fd < 0) {
+			slot = i;
+			break;
+		}
+	}
+	if(slot < 0) {
+		fprintf(stderr, "Too many keyboards, ignoring %s\n", path);
+		return -1;
+	}
+	if(strlen(path) >= MAX_DEVICE_PATH_SIZE) {
+		fprintf(stderr, "keyboard device path %s is too long.\n", path);
+		return -1;
+	}
+
+	int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if(fd == -1) {
+		// Permission denied is expected right after hotplug, udev fixes it and we get IN_ATTRIB
+		if (errno == EACCES || errno == EPERM) {
+			fprintf(stderr, "Permission denied opening %s, skipping\n", path);
+		}
+		return -1;
+	}
+
+	// event timestamps on the same clock as our ticks
+	int clock_id = CLOCK_MONOTONIC;
+	if(evdev_ioctl(fd, EVIOCSCLOCKID, &clock_id) < 0) {
+		perror("Failed to set event clock");
+	}
+
+	Keyboard* d = &k->devices[slot];
+	d->fd = fd;
+	strcpy(d->path, path);
+	device_identity(strrchr(path, '/') + 1, d->id, sizeof(d->id));
+	memset(d->keys, 0, sizeof(d->keys));
+	d->masked = false;
+	d->dropped = false;
+	fprintf(stderr, "Using keyboard %s\n", path);
+	return slot;
+}
+
+static bool key_held_on_any(Keyboards* k, int code) {
+	for(int i = 0; i < MAX_KEYBOARDS; i++) {
+		if(k->devices[i].fd >= 0 && test_bit(k->devices[i].keys, code)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// the action of a key on the active layer, falling through to the base layer
+static Action key_action(Mouse* m, int code) {
+	uint8_t a = config->keymap[m->layer][code];
+	return a == ACTION_INHERIT ? config->keymap[0][code] : a;
+}
+
+// the highest held layer, or the toggled one
+static int active_layer(Mouse* m) {
+	uint32_t held = m->actions & LAYER_HOLD_ACTIONS;
+	if(held) {
+		return 31 - __builtin_clz(held) - ACTION_LAYER_HOLD_1 + 1;
+	}
+	return m->toggled_layer;
+}
+
+static void count_actions(Mouse* m) {
+	memset(m->action_counts, 0, sizeof(m->action_counts));
+	m->actions = 0;
+	for(size_t i = 0; i < KEY_WORDS; i++) {
+		for(unsigned long word = m->keys[i]; word != 0; word &= word - 1) {
+			Action a = key_action(m, i * BITS_PER_LONG + __builtin_ctzl(word));
+			m->action_counts[a]++;
+			m->actions |= ACTION_BIT(a);
+		}
+	}
+	m->actions &= ~ACTION_BIT(ACTION_NONE);
+}
+
+/*
+ * Recount held actions from the merged key bitmap, after a resync, a config
+ * reload or a layer change. Keys already held take their meaning on the new
+ * layer right away, so the next tick already moves or scrolls by it.
+ */
+static void rebuild_actions(Mouse* m) {
+	count_actions(m);
+	int layer = active_layer(m);
+	if(layer != m->layer) {
+		m->layer = layer;
+		count_actions(m);
+	}
+}
+
+// put the pointer straight at x, y through the absolute device
+static void jump_to(Mouse* m, int x, int y) {
+	Frame f;
+	if(m->abs_fd < 0) {
+		return;
+	}
+	f.count = 0;
+	frame_add(&f, EV_ABS, ABS_X, x);
+	frame_add(&f, EV_ABS, ABS_Y, y);
+	frame_flush(&f, m->abs_fd);
+	m->pos_x = x;
+	m->pos_y = y;
+}
+
+// keep one half of the grid region and jump to its center
+static void grid_step(Mouse* m, Action action) {
+	switch(action) {
+	case ACTION_LEFT:
+		m->grid_w = (m->grid_w + 1) / 2;
+		break;
+	case ACTION_RIGHT:
+		m->grid_x += m->grid_w / 2;
+		m->grid_w -= m->grid_w / 2;
+		break;
+	case ACTION_UP:
+		m->grid_h = (m->grid_h + 1) / 2;
+		break;
+	case ACTION_DOWN:
+		m->grid_y += m->grid_h / 2;
+		m->grid_h -= m->grid_h / 2;
+		break;
+	default:
+		return;
+	}
+	jump_to(m, m->grid_x + m->grid_w / 2, m->grid_y + m->grid_h / 2);
+}
+
+// save or recall the mark named by code, whichever the mark key before it asked for
+static void use_mark(Mouse* m, int code) {
+	Action what = m->mark_pending;
+	Mark* mark = NULL;
+
+	m->mark_pending = ACTION_NONE;
+	for(size_t i = 0; i < m->marks_count; i++) {
+		if(m->marks[i].code == code) {
+			mark = &m->marks[i];
+		}
+	}
+	if(what == ACTION_RECALL) {
+		if(mark != NULL) {
+			jump_to(m, mark->x, mark->y);
+		}
+		return;
+	}
+	if(mark == NULL) {
+		if(m->marks_count == MAX_MARKS) {
+			fprintf(stderr, "All %d marks in use\n", MAX_MARKS);
+			return;
+		}
+		mark = &m->marks[m->marks_count++];
+		mark->code = code;
+	}
+	mark->x = m->pos_x;
+	mark->y = m->pos_y;
+}
+
+/*
+ * Grid and mark actions happen once per press, right in the event handler
+ * rather than on a tick. With grid mode on, every motion key halves the
+ * region, so any pixel is about log2(width) + log2(height) presses away.
+ * A click ends grid mode.
+ */
+static void handle_jump_action(Mouse* m, Action action) {
+	if(action == ACTION_GRID) {
+		m->grid_active = !m->grid_active;
+		if(m->grid_active) {
+			m->grid_x = 0;
+			m->grid_y = 0;
+			m->grid_w = config->screen_width;
+			m->grid_h = config->screen_height;
+			jump_to(m, config->screen_width / 2, config->screen_height / 2);
+		}
+	}
+	else if(action == ACTION_MARK || action == ACTION_RECALL) {
+		m->mark_pending = action;
+	}
+	else if(m->grid_active && (ACTION_BIT(action) & MOTION_ACTIONS)) {
+		grid_step(m, action);
+	}
+	else if(ACTION_BIT(action) & BUTTON_ACTIONS) {
+		m->grid_active = false;
+	}
+}
+
+/*
+ * Queue an unbound key for the passthrough keyboard. Forwarded keys go out
+ * with the SYN_REPORT of the packet they came in, so the output has no more
+ * reports than the source.
+ */
+static void forward_key(Mouse* m, int code, int value) {
+	if(m->kbd_fd < 0 || !is_keyboard_key(code)) {
+		return;
+	}
+	// a release of a key whose press the passthrough keyboard never saw
+	if(value == 0 && !test_bit(m->forwarded, code)) {
+		return;
+	}
+	if(m->kbd_frame.count == FRAME_MAX_EVENTS - 1) {
+		frame_flush(&m->kbd_frame, m->kbd_fd);
+	}
+	frame_add(&m->kbd_frame, EV_KEY, code, value);
+	if(value) {
+		set_bit(m->forwarded, code);
+	}
+	else {
+		clear_bit(m->forwarded, code);
+	}
+}
+
+// release forwarded keys that are not in keep, or all of them with keep NULL
+static void release_forwarded(Mouse* m, const unsigned long* keep) {
+	if(m->kbd_fd < 0) {
+		return;
+	}
+	for(size_t i = 0; i < KEY_WORDS; i++) {
+		unsigned long word = m->forwarded[i] & (keep ? ~keep[i] : ~0UL);
+		for(; word != 0; word &= word - 1) {
+			forward_key(m, i * BITS_PER_LONG + __builtin_ctzl(word), 0);
+		}
+	}
+	frame_flush(&m->kbd_frame, m->kbd_fd);
+}
+
+// rebuild the merged key bitmap from every device's own view
+static void merge_key_states(Keyboards* k, Mouse* m) {
+	memset(m->keys, 0, sizeof(m->keys));
+	for(int i = 0; i < MAX_KEYBOARDS; i++) {
+		if(k->devices[i].fd < 0) {
+			continue;
+		}
+		for(size_t w = 0; w < KEY_WORDS; w++) {
+			m->keys[w] |= k->devices[i].keys[w];
+		}
+	}
+	rebuild_actions(m);
+	// releases lost to SYN_DROPPED or an unplug must reach the passthrough keyboard too
+	release_forwarded(m, m->keys);
+}
+
+static void remove_keyboard(Keyboards* k, Keyboard* d, Mouse* m) {
+	fprintf(stderr, "Keyboard removed %s\n", d->path);
+#ifdef MOUSE_MOVE_IO_URING
+	if(uring != NULL) {
+		uring_cancel(uring, d - k->devices);
+	}
+#endif
+#ifdef MOUSE_MOVE_THREADS
+	if(input_thread != NULL) {
+		input_thread_forget(input_thread, d->fd);
+	}
+#endif
+	close(d->fd); // also drops it from epoll
+	d->fd = -1;
+	merge_key_states(k, m);
+}
+
+// with KEYBOARD_DEVICE or -d set only that device is used, otherwise any keyboard
+static bool wanted_device_path(const char* path) {
+	char configured[PATH_MAX];
+	if(keyboard_device[0] == '\0') {
+		return true;
+	}
+	// resolve every time, by-id symlinks may point elsewhere after a replug
+	if(realpath(keyboard_device, configured) == NULL) {
+		return false;
+	}
+	return strcmp(configured, path) == 0;
+}
+
+typedef struct {
+	char name[16];
+	int score;
+} Candidate;
+
+static int compare_candidates(const void* a, const void* b) {
+	return ((const Candidate*) b)->score - ((const Candidate*) a)->score;
+}
+
+// open every keyboard listed in sysfs, best match for the bindings first
+static int find_keyboard_devices(Keyboards* k) {
+	Candidate candidates[MAX_DEVICES];
+	size_t n = 0;
+	char path[MAX_DEVICE_PATH_SIZE];
+	int found = 0;
+
+	DIR* dir = opendir(SYSFS_INPUT_DIR);
+	if(dir == NULL) {
+		perror("Error listing " SYSFS_INPUT_DIR);
+		return 0;
+	}
+	struct dirent* entry;
+	while((entry = readdir(dir)) != NULL && n < MAX_DEVICES) {
+		if(strncmp(entry->d_name, "event", 5) != 0 || strlen(entry->d_name) >= sizeof(candidates[n].name)) {
+			continue;
+		}
+		int score = keyboard_score(entry->d_name);
+		if(score < 0) {
+			continue;
+		}
+		strcpy(candidates[n].name, entry->d_name);
+		candidates[n].score = score;
+		n++;
+	}
+	closedir(dir);
+
+	qsort(candidates, n, sizeof(candidates[0]), compare_candidates);
+	for(size_t i = 0; i < n; i++) {
+		if(snprintf(path, sizeof(path), INPUT_DIR "/%s", candidates[i].name) >= (int) sizeof(path)) {
+			continue;
+		}
+		if(add_keyboard(k, path) >= 0) {
+			fprintf(stderr, "  %s can produce %d bound keys\n", candidates[i].name, candidates[i].score);
+			found++;
+		}
+	}
+	return found;
+}
+
+int init_keyboards(Keyboards* k) {
+	char path[PATH_MAX];
+
+	for(int i = 0; i < MAX_KEYBOARDS; i++) {
+		k->devices[i].fd = -1;
+	}
+	k->lost_count = 0;
+
+	if(keyboard_device[0] != '\0') {
+		if(realpath(keyboard_device, path) == NULL) {
+			perror("Error opening device");
+			fprintf(stderr, "Incorrect path provided in config.h or -d, make sure its a keyboard device path\n");
+			return 1;
+		}
+		const char* name = strrchr(path, '/') + 1;
+		if(keyboard_score(name) < 0) {
+			fprintf(stderr, "Device provided does not look like a keyboard, make sure it can produce the start combo\n");
+			return 1;
+		}
+		if(add_keyboard(k, path) < 0) {
+			fprintf(stderr, "Failed to open %s, if this is your keyboard device, make sure to run the program with root access (sudo)\n", path);
+			return 1;
+		}
+		return 0;
+	}
+
+	if(find_keyboard_devices(k) == 0) {
+		fprintf(stderr, "No keyboard device found, waiting for one to be plugged in\n");
+	}
+	return 0;
+}
+
+void destroy_keyboards(Keyboards* k) {
+	for(int i = 0; i < MAX_KEYBOARDS; i++) {
+		if(k->devices[i].fd >= 0) {
+			close(k->devices[i].fd);
+			k->devices[i].fd = -1;
+		}
+	}
+}
+
+// everything but the uinput device, shared with the replay harness
+int init_mouse_state(Mouse* m) {
+	memset(m->keys, 0, sizeof(m->keys));
+	m->motion_speed = SPEED_NORMAL;
+	m->base_tier = TIER_NORMAL;
+	m->motion_remainder_x = 0;
+	m->motion_remainder_y = 0;
+	m->motion_start = 0;
+	m->motion_last = 0;
+	m->click_key_time = 0;
+	m->motion_key_time = 0;
+	memset(m->action_counts, 0, sizeof(m->action_counts));
+	m->actions = 0;
+
+	m->scroll_speed = SCROLL_SPEED_NORMAL;
+	m->scroll_velocity_x = 0;
+	m->scroll_velocity_y = 0;
+	m->scroll_fraction_x = 0;
+	m->scroll_fraction_y = 0;
+	m->scroll_notch_x = 0;
+	m->scroll_notch_y = 0;
+
+	m->click_deadline = 0;
+	m->scroll_deadline = 0;
+	m->motion_deadline = 0;
+
+	m->buttons_pressed = 0;
+	m->layer = 0;
+	m->toggled_layer = 0;
+
+	m->frame.count = 0;
+
+	m->kbd_uidev = NULL;
+	m->kbd_fd = -1;
+	m->kbd_frame.count = 0;
+	memset(m->forwarded, 0, sizeof(m->forwarded));
+
+	m->abs_uidev = NULL;
+	m->abs_fd = -1;
+	// unknown until the first jump, the center is the best guess
+	m->pos_x = config->screen_width / 2;
+	m->pos_y = config->screen_height / 2;
+	m->grid_active = false;
+	m->mark_pending = ACTION_NONE;
+	m->mark_key = KEY_RESERVED;
+	m->marks_count = 0;
+	return 0;
+}
+
+int init_mouse(Mouse* m, int uifd) {
+	if(init_mouse_state(m) != 0) {
+		return 1;
+	}
+	m->uifd = uifd;
+	m->uidev = create_uinput_mouse_dev(uifd);
+	if(m->uidev == NULL) {
+		perror("Error creating mouse device");
+		return 1;
+	}
+	// grid mode and marks are off without it, the mouse itself still works
+	m->abs_uidev = create_uinput_abs_dev();
+	if(m->abs_uidev != NULL) {
+		m->abs_fd = libevdev_uinput_get_fd(m->abs_uidev);
+	}
+	if(PASSTHROUGH_KEYS) {
+		// without it unbound keys are swallowed as before, not worth failing over
+		m->kbd_uidev = create_uinput_keyboard_dev();
+		if(m->kbd_uidev != NULL) {
+			m->kbd_fd = libevdev_uinput_get_fd(m->kbd_uidev);
+		}
+	}
+	return 0;
+}
+
+void destroy_mouse(Mouse* m) {
+	libevdev_uinput_destroy(m->uidev);
+	if(m->kbd_uidev != NULL) {
+		libevdev_uinput_destroy(m->kbd_uidev);
+	}
+	if(m->abs_uidev != NULL) {
+		libevdev_uinput_destroy(m->abs_uidev);
+	}
+}
+
+/*
+ * The screen size changed with the config: the absolute device is created
+ * again with the new range, and what points into the old screen is clamped
+ * to the new one. Grid mode ends, its region no longer halves the screen.
+ */
+static void resize_screen(Mouse* m, int old_width, int old_height) {
+	if(config->screen_width == old_width && config->screen_height == old_height) {
+		return;
+	}
+	if(m->abs_uidev != NULL) {
+		libevdev_uinput_destroy(m->abs_uidev);
+		m->abs_fd = -1;
+		m->abs_uidev = create_uinput_abs_dev();
+		if(m->abs_uidev != NULL) {
+			m->abs_fd = libevdev_uinput_get_fd(m->abs_uidev);
+		}
+	}
+	m->pos_x = MIN(m->pos_x, config->screen_width - 1);
+	m->pos_y = MIN(m->pos_y, config->screen_height - 1);
+	for(size_t i = 0; i < m->marks_count; i++) {
+		m->marks[i].x = MIN(m->marks[i].x, config->screen_width - 1);
+		m->marks[i].y = MIN(m->marks[i].y, config->screen_height - 1);
+	}
+	m->grid_active = false;
+}
+
+static int grab_keyboard(int fd) {
+	int err = evdev_ioctl(fd, EVIOCGRAB, 1);
+	if(err < 0) {
+		perror("Failed to grab input device");
+	}
+	return err;
+}
+
+static int ungrab_keyboard(int fd) {
+	int err = evdev_ioctl(fd, EVIOCGRAB, 0);
+	if(err < 0) {
+		perror("Failed to ungrab input device");
+	}
+	return err;
+}
+
+static int grab_keyboards(Keyboards* k) {
+	for(int i = 0; i < MAX_KEYBOARDS; i++) {
+		if(k->devices[i].fd >= 0 && grab_keyboard(k->devices[i].fd) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int ungrab_keyboards(Keyboards* k) {
+	int err = 0;
+	for(int i = 0; i < MAX_KEYBOARDS; i++) {
+		if(k->devices[i].fd >= 0 && ungrab_keyboard(k->devices[i].fd) < 0) {
+			err = -1;
+		}
+	}
+	return err;
+}
+
+
+static bool are_keys_released(int fd) {
+	unsigned long keys[KEY_WORDS] = {0};
+	if(evdev_ioctl(fd, EVIOCGKEY(sizeof(keys)), keys) < 0) {
+		perror("EVIOCGKEY failed");
+		return false;
+	}
+	for(size_t i = 0; i < KEY_WORDS; i++) {
+		if(keys[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool are_all_keys_released(Keyboards* k) {
+	for(int i = 0; i < MAX_KEYBOARDS; i++) {
+		if(k->devices[i].fd >= 0 && !are_keys_released(k->devices[i].fd)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void clear_key_states(Keyboards* k, Mouse* m) {
+	for(int i = 0; i < MAX_KEYBOARDS; i++) {
+		memset(k->devices[i].keys, 0, sizeof(k->devices[i].keys));
+	}
+	memset(m->keys, 0, sizeof(m->keys));
+	rebuild_actions(m);
+}
+
+// after SYN_DROPPED the event stream can't be trusted, take key state from the kernel
+static void resync_key_states(Keyboards* k, Keyboard* d, Mouse* m) {
+	if(evdev_ioctl(d->fd, EVIOCGKEY(sizeof(d->keys)), d->keys) < 0) {
+		perror("EVIOCGKEY failed");
+		return;
+	}
+	merge_key_states(k, m);
+}
+
+static bool keys_released(const unsigned long* keys) {
+	for(size_t i = 0; i < KEY_WORDS; i++) {
+		if(keys[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool event_masks_unsupported;
+
+// pass only the EV_KEY codes in keys, and EV_SYN, from d to us
+static void set_event_mask(Keyboard* d, const unsigned long* keys) {
+	static const uint16_t blocked_types[] = { EV_REL, EV_ABS, EV_MSC, EV_SW, EV_LED, EV_SND, EV_FF };
+	struct input_mask mask = {
+		.type = EV_KEY,
+		.codes_size = sizeof(d->mask),
+		.codes_ptr = (uintptr_t) keys,
+	};
+	if(evdev_ioctl(d->fd, EVIOCSMASK, &mask) < 0) {
+		// before Linux 4.4, everything keeps coming as it always did
+		perror("Kernel event filtering unavailable, EVIOCSMASK failed");
+		event_masks_unsupported = true;
+		return;
+	}
+	memcpy(d->mask, keys, sizeof(d->mask));
+	if(d->masked) {
+		return;
+	}
+	// an empty mask blocks the whole type, scancodes (EV_MSC) above all
+	for(size_t i = 0; i < sizeof(blocked_types) / sizeof(blocked_types[0]); i++) {
+		mask = (struct input_mask){ .type = blocked_types[i], .codes_size = 0, .codes_ptr = 0 };
+		if(evdev_ioctl(d->fd, EVIOCSMASK, &mask) < 0) {
+			perror("Failed to filter event type");
+		}
+	}
+	d->masked = true;
+}
+
+/*
+ * Keep events we would discard in the kernel: it skips a SYN_REPORT when
+ * nothing before it passed the mask, so a filtered key doesn't wake us up.
+ * Idle that is every key outside the start combo, while grabbing every key
+ * without an action unless it is typed through the passthrough keyboard or
+ * names a mark. Waiting for the grab needs every release. Keys held stay
+ * in, their release must not be lost.
+ */
+static void update_event_masks(Keyboards* k, Mouse* m, Mode mode) {
+	unsigned long want[KEY_WORDS];
+	if(event_masks_unsupported) {
+		return;
+	}
+	if(mode == MODE_PENDING_GRAB || (mode == MODE_GRABBING && (m->kbd_fd >= 0 || m->mark_pending != ACTION_NONE))) {
+		memset(want, 0xff, sizeof(want));
+	}
+	else if(mode == MODE_GRABBING) {
+		for(size_t i = 0; i < KEY_WORDS; i++) {
+			want[i] = config->bound_keys[i] | config->exit_combo.mask[i] | config->kill_combo.mask[i] | m->keys[i];
+		}
+	}
+	else {
+		for(size_t i = 0; i < KEY_WORDS; i++) {
+			want[i] = config->start_combo.mask[i] | m->keys[i];
+		}
+	}
+	if(m->mark_key != KEY_RESERVED) {
+		set_bit(want, m->mark_key);
+	}
+	for(int i = 0; i < MAX_KEYBOARDS && !event_masks_unsupported; i++) {
+		Keyboard* d = &k->devices[i];
+		if(d->fd >= 0 && (!d->masked || memcmp(d->mask, want, sizeof(want)) != 0)) {
+			set_event_mask(d, want);
+		}
+	}
+}
+
+/*
+ * Grabbing while a key is down would hide its release from the compositor
+ * and leave it stuck there, so after the start combo the keyboards stay
+ * ungrabbed and releases are tracked from the event stream. Keys held since
+ * before we saw them are picked up from the kernel once, here.
+ */
+static void begin_pending_grab(Keyboards* k, Mouse* m, Mode* mode) {
+	*mode = MODE_PENDING_GRAB;
+	// every release has to come through from before the resync on
+	update_event_masks(k, m, *mode);
+	for(int i = 0; i < MAX_KEYBOARDS; i++) {
+		if(k->devices[i].fd >= 0) {
+			resync_key_states(k, &k->devices[i], m);
+		}
+	}
+}
+
+// grab once nothing is held any more, release_time is when the last key went up
+static void try_pending_grab(Keyboards* k, Mouse* m, Mode* mode, uint64_t release_time) {
+	if(*mode != MODE_PENDING_GRAB || !keys_released(m->keys)) {
+		return;
+	}
+	stats.grab_attempts++;
+	if(grab_keyboards(k) < 0) {
+		perror("error grabbing keyboard");
+		ungrab_keyboards(k);
+		*mode = MODE_IDLE;
+		return;
+	}
+	// a key pressed between the last release and the grab: let its release through, its press is queued
+	if(!are_all_keys_released(k)) {
+		ungrab_keyboards(k);
+		return;
+	}
+	uint64_t now = now_ns();
+	hist_add(&latency.grab_activation, now - MIN(now, release_time));
+	clear_key_states(k, m);
+	*mode = MODE_GRABBING;
+	stats.grab_start = now;
+}
+
+// back to MODE_IDLE, nothing of this mouse mode carries over to the next
+static void end_mouse_mode(Keyboards* k, Mouse* m, Mode* mode) {
+	release_forwarded(m, NULL);
+	m->grid_active = false;
+	m->mark_pending = ACTION_NONE;
+	m->scroll_velocity_x = 0;
+	m->scroll_velocity_y = 0;
+	m->toggled_layer = 0;
+	clear_key_states(k, m);
+	// no tick follows in idle, buttons still down on the virtual mouse go up now
+	handle_click(m);
+	frame_flush(&m->frame, m->uifd);
+	if(stats.grab_start != 0) {
+		stats.grabbed_ns += now_ns() - stats.grab_start;
+		stats.grab_start = 0;
+	}
+	// while pending nothing is grabbed, try_pending_grab lets go of a partial grab
+	if(*mode == MODE_GRABBING) {
+		ungrab_keyboards(k);
+	}
+	*mode = MODE_IDLE;
+}
+
+static void process_event(struct input_event* event, Keyboard* d, Keyboards* k, Mouse* m, Mode* mode, bool* quit) {
+	if(event->type != EV_KEY || event->code >= KEY_CNT) {
+		if(event->type != EV_SYN) {
+			stats.discarded++;
+		}
+		return;
+	}
+	int code = event->code;
+	int value = event->value;
+	bool was_held = test_bit(m->keys, code);
+	bool held = value != 0;
+
+	// autorepeat changes no state, only keys typed through the passthrough keyboard repeat
+	if(value == 2) {
+		if(*mode == MODE_GRABBING && test_bit(m->forwarded, code)) {
+			forward_key(m, code, value);
+		}
+		return;
+	}
+
+	// the key naming a mark does nothing else
+	if(code == m->mark_key) {
+		m->mark_key = KEY_RESERVED;
+	}
+	else if(value == 1 && *mode == MODE_GRABBING && m->mark_pending != ACTION_NONE) {
+		// only the device view has it, its release then changes no action
+		set_bit(d->keys, code);
+		m->mark_key = code;
+		use_mark(m, code);
+		return;
+	}
+
+	// a key counts as held while any keyboard holds it, so combos work across devices
+	if(held) {
+		set_bit(d->keys, code);
+		set_bit(m->keys, code);
+	}
+	else {
+		clear_bit(d->keys, code);
+		held = key_held_on_any(k, code);
+		if(!held) {
+			clear_bit(m->keys, code);
+		}
+	}
+
+	// one table lookup turns the key into the action it drives
+	Action action = key_action(m, code);
+	if(action != ACTION_NONE && was_held != held) {
+		if(held) {
+			m->action_counts[action]++;
+			m->actions |= ACTION_BIT(action);
+		}
+		else if(--m->action_counts[action] == 0) {
+			m->actions &= ~ACTION_BIT(action);
+		}
+
+		// remember when the key behind the next click or first motion step arrived
+		if(*mode == MODE_GRABBING) {
+			if(m->click_key_time == 0 && (ACTION_BIT(action) & BUTTON_ACTIONS)) {
+				m->click_key_time = event_time_ns(event);
+			}
+			if(m->motion_key_time == 0 && m->motion_start == 0 && value && (ACTION_BIT(action) & MOTION_ACTIONS)) {
+				m->motion_key_time = event_time_ns(event);
+			}
+			if(held) {
+				handle_jump_action(m, action);
+			}
+			if(held && (ACTION_BIT(action) & LAYER_TOGGLE_ACTIONS)) {
+				int layer = action - ACTION_LAYER_TOGGLE_1 + 1;
+				m->toggled_layer = m->toggled_layer == layer ? 0 : layer;
+			}
+		}
+		if(ACTION_BIT(action) & (LAYER_HOLD_ACTIONS | LAYER_TOGGLE_ACTIONS)) {
+			rebuild_actions(m);
+		}
+	}
+
+
+	if(*mode == MODE_IDLE && combo_pressed(m->keys, &config->start_combo)) {
+		begin_pending_grab(k, m, mode);
+	}
+	else if(*mode == MODE_PENDING_GRAB && !held) {
+		try_pending_grab(k, m, mode, event_time_ns(event));
+	}
+	else if(*mode == MODE_GRABBING) {
+		// the key completing a combo is not forwarded, the rest of the combo is released
+		if(combo_pressed(m->keys, &config->exit_combo)) {
+			end_mouse_mode(k, m, mode);
+		}
+		else if(combo_pressed(m->keys, &config->kill_combo)) {
+			release_forwarded(m, NULL);
+			*quit = true;
+			ungrab_keyboards(k);
+		}
+		else if(action == ACTION_NONE || value == 0) {
+			// a release still goes out if the key got bound by a reload while held
+			forward_key(m, code, value);
+		}
+	}
+}
+
+
+/*
+ * Run one batch of raw events from a keyboard through process_event. On
+ * SYN_DROPPED everything up to and including the next SYN_REPORT is
+ * discarded and the device's keys are resynced from EVIOCGKEY, as
+ * described in the evdev protocol.
+ */
+static void process_events(struct input_event* events, size_t n, Keyboard* d, Keyboards* k, Mouse* m, Mode* mode, bool* quit) {
+	for(size_t i = 0; i < n && !(*quit); i++) {
+		struct input_event* event = &events[i];
+		if(event->type == EV_SYN && event->code == SYN_DROPPED) {
+			stats.syn_dropped++;
+			d->dropped = true;
+			continue;
+		}
+		if(d->dropped) {
+			if(event->type == EV_SYN && event->code == SYN_REPORT) {
+				d->dropped = false;
+				resync_key_states(k, d, m);
+				try_pending_grab(k, m, mode, now_ns());
+			}
+			continue;
+		}
+		process_event(event, d, k, m, mode, quit);
+		if(event->type == EV_SYN && event->code == SYN_REPORT) {
+			frame_flush(&m->kbd_frame, m->kbd_fd);
+		}
+	}
+}
+
+static void record_events(struct input_event* events, size_t n) {
+	for(size_t i = 0; i < n; i++) {
+		Record r = {
+			.time_ns = event_time_ns(&events[i]),
+			.type = events[i].type,
+			.code = events[i].code,
+			.value = events[i].value,
+		};
+		fwrite(&r, sizeof(r), 1, record_file);
+	}
+	// a recording cut short by a signal should still be usable
+	fflush(record_file);
+}
+
+/*
+ * Drain a keyboard fd, EVENT_BUFFER_SIZE events per read(2), and process
+ * each read as one batch. Returns the errno of a failed read, 0 otherwise.
+ */
+static int read_events(Keyboard* d, Keyboards* k, Mouse* m, Mode* mode, bool* quit) {
+	struct input_event events[EVENT_BUFFER_SIZE];
+	ssize_t bytes_read;
+
+	do {
+		stats.syscalls++;
+		bytes_read = read(d->fd, events, sizeof(events));
+		if(bytes_read < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			return errno;
+		}
+		size_t n = (size_t)bytes_read / sizeof(events[0]);
+		stats.reads++;
+		stats.events += n;
+
+		if(record_file != NULL) {
+			record_events(events, n);
+		}
+		process_events(events, n, d, k, m, mode, quit);
+	} while(bytes_read == (ssize_t)sizeof(events) && !(*quit));
+	return 0;
+}
+
+static int watch_fd(int epoll_fd, int fd, uint32_t source) {
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u32 = source,
+	};
+	int err = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	if(err < 0) {
+		perror("Failed to watch fd");
+	}
+	return err;
+}
+
+// keyboards are read through the ring or by the input thread when there is one, epoll otherwise
+static int watch_keyboard(int epoll_fd, Keyboards* k, int slot) {
+#ifdef MOUSE_MOVE_IO_URING
+	if(uring != NULL) {
+		uring_read(uring, k->devices[slot].fd, slot);
+		return 0;
+	}
+#endif
+#ifdef MOUSE_MOVE_THREADS
+	if(input_thread != NULL) {
+		return input_thread_watch(input_thread, k->devices[slot].fd, slot);
+	}
+#endif
+	return watch_fd(epoll_fd, k->devices[slot].fd, slot);
+}
+
+/*
+ * A keyboard stopped working: unplugged, reset, or revoked across a suspend.
+ * Mouse mode ends so nothing stays grabbed or held on the virtual mouse, and
+ * the keyboard is waited for so its return can be reported. The virtual
+ * devices stay, the compositor never sees them go.
+ */
+static void lose_keyboard(Keyboards* k, Keyboard* d, Mouse* m, Mode* mode) {
+	if(d->id[0] != '\0' && k->lost_count < MAX_KEYBOARDS) {
+		LostKeyboard* l = &k->lost[k->lost_count++];
+		strcpy(l->id, d->id);
+		l->time = now_ns();
+	}
+	remove_keyboard(k, d, m);
+	if(*mode != MODE_IDLE) {
+		end_mouse_mode(k, m, mode);
+	}
+}
+
+// index of the lost keyboard event_name is, or -1
+static int find_lost_keyboard(Keyboards* k, const char* event_name) {
+	char id[DEVICE_ID_SIZE];
+	if(k->lost_count == 0) {
+		return -1;
+	}
+	device_identity(event_name, id, sizeof(id));
+	for(int i = 0; i < k->lost_count; i++) {
+		if(strcmp(k->lost[i].id, id) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void forget_lost_keyboard(Keyboards* k, int i) {
+	k->lost[i] = k->lost[--k->lost_count];
+}
+
+/*
+ * Open a keyboard that appeared. A lost one is taken back by its identity
+ * even when KEYBOARD_DEVICE named its old event node.
+ */
+static void attach_keyboard(Keyboards* k, Mouse* m, int epoll_fd, const char* event_name, Mode mode) {
+	char path[MAX_DEVICE_PATH_SIZE];
+	if(snprintf(path, sizeof(path), INPUT_DIR "/%s", event_name) >= (int) sizeof(path)) {
+		return;
+	}
+	int lost = find_lost_keyboard(k, event_name);
+	if(find_keyboard(k, path) != NULL || (lost < 0 && !wanted_device_path(path)) || keyboard_score(event_name) < 0) {
+		return;
+	}
+	int slot = add_keyboard(k, path);
+	if(slot < 0) {
+		return;
+	}
+	if(watch_keyboard(epoll_fd, k, slot) < 0) {
+		remove_keyboard(k, &k->devices[slot], m);
+		return;
+	}
+	if(lost >= 0) {
+		fprintf(stderr, "Keyboard %s back after %.1f ms\n", k->lost[lost].id, (now_ns() - k->lost[lost].time) / 1e6);
+		forget_lost_keyboard(k, lost);
+	}
+	// a keyboard plugged in while in mouse mode is grabbed right away
+	if(mode == MODE_GRABBING) {
+		grab_keyboard(k->devices[slot].fd);
+	}
+}
+
+/*
+ * Keyboards come and go as nodes appear and disappear in /dev/input.
+ * IN_ATTRIB is watched as well because udev usually fixes the node's
+ * permissions only after it has been created.
+ */
+static void handle_hotplug(int inotify_fd, int epoll_fd, Keyboards* k, Mouse* m, Mode* mode) {
+	char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char path[MAX_DEVICE_PATH_SIZE];
+	ssize_t len;
+
+	while((len = read(inotify_fd, buff, sizeof(buff))) > 0) {
+		for(char* ptr = buff; ptr < buff + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event*) ptr)->len) {
+			struct inotify_event* ev = (struct inotify_event*) ptr;
+			if(ev->len == 0 || strncmp(ev->name, "event", 5) != 0) {
+				continue;
+			}
+			if(!(ev->mask & IN_DELETE)) {
+				attach_keyboard(k, m, epoll_fd, ev->name, *mode);
+				continue;
+			}
+			if(snprintf(path, sizeof(path), INPUT_DIR "/%s", ev->name) >= (int) sizeof(path)) {
+				continue;
+			}
+			Keyboard* d = find_keyboard(k, path);
+			if(d != NULL) {
+				lose_keyboard(k, d, m, mode);
+			}
+		}
+	}
+}
+
+/*
+ * While a keyboard is lost sysfs is rescanned every RECONNECT_POLL_MS, in
+ * case its node came back with no inotify event we could use (permissions
+ * fixed late, queue overflow across a suspend). After RECONNECT_TIMEOUT_MS
+ * it is given up on and only hotplug can bring it back, unannounced.
+ */
+static void handle_reconnect(int epoll_fd, Keyboards* k, Mouse* m, Mode mode) {
+	DIR* dir = opendir(SYSFS_INPUT_DIR);
+	if(dir != NULL) {
+		struct dirent* entry;
+		while((entry = readdir(dir)) != NULL && k->lost_count > 0) {
+			if(strncmp(entry->d_name, "event", 5) == 0) {
+				attach_keyboard(k, m, epoll_fd, entry->d_name, mode);
+			}
+		}
+		closedir(dir);
+	}
+	uint64_t now = now_ns();
+	for(int i = k->lost_count - 1; i >= 0; i--) {
+		if(now - k->lost[i].time >= RECONNECT_TIMEOUT_MS * 1000000ULL) {
+			fprintf(stderr, "Keyboard %s did not come back within %d ms\n", k->lost[i].id, RECONNECT_TIMEOUT_MS);
+			forget_lost_keyboard(k, i);
+		}
+	}
+}
+
+/*
+ * Re-read the config file after it changed. The new config is complete
+ * before the pointer is swapped, and held keys are re-resolved through the
+ * new keymap, so the grab and anything held survive the reload. A broken
+ * file leaves the running config in place.
+ */
+static void reload_config(Mouse* m) {
+	Config* c = load_config(config_path);
+	if(c == NULL) {
+		fprintf(stderr, "Keeping the previous config\n");
+		return;
+	}
+	Config* old = config;
+	config = c;
+	resize_screen(m, old->screen_width, old->screen_height);
+	free(old);
+	rebuild_actions(m);
+	fprintf(stderr, "Reloaded %s\n", config_path);
+}
+
+// watch the directory, editors usually replace the file instead of writing it
+static int watch_config(void) {
+	char dir[PATH_MAX];
+	struct stat st;
+	// -c /dev/null and the like have nothing to reload
+	if(config_path[0] == '\0' || (stat(config_path, &st) == 0 && !S_ISREG(st.st_mode))) {
+		return -1;
+	}
+	snprintf(dir, sizeof(dir), "%s", config_path);
+	char* slash = strrchr(dir, '/');
+	if(slash == NULL) {
+		strcpy(dir, ".");
+	}
+	else if(slash == dir) {
+		dir[1] = '\0';
+	}
+	else {
+		*slash = '\0';
+	}
+
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(fd < 0) {
+		perror("Failed to watch config");
+		return -1;
+	}
+	if(inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0) {
+		// no config directory, nothing to reload
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void handle_config_change(int inotify_fd, Mouse* m) {
+	char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const char* slash = strrchr(config_path, '/');
+	const char* name = slash ? slash + 1 : config_path;
+	bool changed = false;
+	ssize_t len;
+
+	while((len = read(inotify_fd, buff, sizeof(buff))) > 0) {
+		for(char* ptr = buff; ptr < buff + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event*) ptr)->len) {
+			struct inotify_event* ev = (struct inotify_event*) ptr;
+			if(ev->len > 0 && strcmp(ev->name, name) == 0) {
+				changed = true;
+			}
+		}
+	}
+	// one reload for a whole burst of editor writes
+	if(changed) {
+		reload_config(m);
+	}
+}
+
+static void print_histogram(FILE* f, const char* name, Histogram* h) {
+	fprintf(f, " %s_n=%llu %s_p50_us=%.1f %s_p99_us=%.1f %s_max_us=%.1f",
+		name, (unsigned long long)h->count,
+		name, hist_percentile(h, 0.50) / 1e3,
+		name, hist_percentile(h, 0.99) / 1e3,
+		name, h->max / 1e3);
+}
+
+// one machine-parsable key=value line
+static void print_stats(FILE* f) {
+	uint64_t now = now_ns();
+	uint64_t grabbed_ns = stats.grabbed_ns + (stats.grab_start != 0 ? now - stats.grab_start : 0);
+	double uptime_s = (now - stats.start) / 1e9;
+	uint64_t discarded = stats.discarded;
+#ifdef MOUSE_MOVE_THREADS
+	if(input_thread != NULL) {
+		discarded += __atomic_load_n(&input_thread->discarded, __ATOMIC_RELAXED);
+	}
+#endif
+	fprintf(f, "time=%lld uptime_s=%.0f wakeups=%llu wakeups_per_s=%.2f events=%llu reads=%llu events_per_read=%.2f discarded=%llu syn_dropped=%llu syscalls=%llu",
+		(long long)time(NULL), uptime_s,
+		(unsigned long long)stats.wakeups, uptime_s > 0 ? stats.wakeups / uptime_s : 0.0,
+		(unsigned long long)stats.events, (unsigned long long)stats.reads,
+		stats.reads ? (double)stats.events / stats.reads : 0.0,
+		(unsigned long long)discarded,
+		(unsigned long long)stats.syn_dropped, (unsigned long long)stats.syscalls);
+	fprintf(f, " frames=%llu empty_ticks=%llu grab_attempts=%llu grabbed_s=%.1f",
+		(unsigned long long)stats.frames, (unsigned long long)stats.empty_ticks,
+		(unsigned long long)stats.grab_attempts, grabbed_ns / 1e9);
+	print_histogram(f, "key_to_click", &latency.key_to_click);
+	print_histogram(f, "key_to_motion", &latency.key_to_motion);
+	print_histogram(f, "tick_jitter", &latency.tick_jitter);
+	print_histogram(f, "grab_activation", &latency.grab_activation);
+	fputc('\n', f);
+	fflush(f);
+}
+
+static void append_stats_file(void) {
+	FILE* f = fopen(STATS_FILE, "ae");
+	if(f == NULL) {
+		perror("Failed to open " STATS_FILE);
+		return;
+	}
+	print_stats(f);
+	fclose(f);
+}
+
+// touch the stack the loop will use now, so mlockall keeps it resident
+static void prefault_stack(void) {
+	volatile char stack[STACK_PREFAULT_SIZE];
+	for(size_t i = 0; i < sizeof(stack); i += 4096) {
+		stack[i] = 0;
+	}
+}
+
+/*
+ * Opt-in realtime mode from config.h, entered right before the loop when
+ * every buffer the steady state uses already exists: pin to REALTIME_CPU,
+ * lock all memory so nothing is paged out or faulted in later, and switch
+ * to REALTIME_POLICY. A failure is reported and the loop runs anyway.
+ */
+static void setup_realtime(void) {
+	if(REALTIME_CPU >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(REALTIME_CPU, &cpus);
+		if(sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+			perror("Failed to pin to REALTIME_CPU");
+		}
+	}
+	if(REALTIME_PRIORITY <= 0) {
+		return;
+	}
+
+	prefault_stack();
+	if(mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		perror("Failed to lock memory");
+	}
+	struct sched_param param = { .sched_priority = REALTIME_PRIORITY };
+	if(sched_setscheduler(0, REALTIME_POLICY, &param) < 0) {
+		perror("Failed to set realtime scheduling");
+		return;
+	}
+	fprintf(stderr, "Realtime: %s priority %d\n",
+		REALTIME_POLICY == SCHED_RR ? "SCHED_RR" : "SCHED_FIFO", REALTIME_PRIORITY);
+}
+
+// arm the timer to an absolute deadline, 0 disarms it
+static int arm_timer(int timer_fd, uint64_t deadline) {
+	struct itimerspec its = {0};
+	if(deadline != 0) {
+		its.it_value.tv_sec = deadline / 1000000000ULL;
+		its.it_value.tv_nsec = deadline % 1000000000ULL;
+	}
+	stats.syscalls++;
+	int err = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	if(err < 0) {
+		perror("Failed to arm timer");
+	}
+	return err;
+}
+
+/*
+ * The state block for status bars and overlays: a memfd sealed so that
+ * clients can only map it read-only and can't resize it. Without it only
+ * the state_fd command fails.
+ */
+static int create_shared_state(void) {
+	int fd = memfd_create("mouse_move_state", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(fd < 0 || ftruncate(fd, sizeof(struct mouse_move_state)) < 0) {
+		perror("Failed to create the state block");
+		if(fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	struct mouse_move_state* block = mmap(NULL, sizeof(*block), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(block == MAP_FAILED) {
+		perror("Failed to map the state block");
+		close(fd);
+		return -1;
+	}
+	// in steps, a kernel without F_SEAL_FUTURE_WRITE still gets the others
+	if(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+		perror("Failed to seal the state block size");
+	}
+	// our mapping stays writable, F_SEAL_FUTURE_WRITE needs Linux 5.1
+	if(fcntl(fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE) < 0) {
+		perror("Failed to seal the state block, clients can write to it");
+	}
+	if(fcntl(fd, F_ADD_SEALS, F_SEAL_SEAL) < 0) {
+		perror("Failed to seal the state block seals");
+	}
+	block->version = MOUSE_MOVE_STATE_VERSION;
+	shared_state.fd = fd;
+	shared_state.block = block;
+	return 0;
+}
+
+static void destroy_shared_state(void) {
+	if(shared_state.block != NULL) {
+		munmap(shared_state.block, sizeof(*shared_state.block));
+		close(shared_state.fd);
+		shared_state.block = NULL;
+		shared_state.fd = -1;
+	}
+}
+
+/*
+ * Bring the state block up to date, once per loop iteration before it
+ * sleeps: a few stores under the seqlock, readers retry rather than being
+ * waited for. Clients watching it get an eventfd write only when more than
+ * the counters changed.
+ */
+static void publish_state(Keyboards* k, Mouse* m, Mode mode, Control* c) {
+	struct mouse_move_state* s = shared_state.block;
+	if(s == NULL) {
+		return;
+	}
+	Tier tier = speed_tier(m);
+	uint32_t speed = config->motion_speeds[tier];
+	uint32_t buttons = 0;
+	for(uint32_t held = m->buttons_pressed; held != 0; held &= held - 1) {
+		buttons |= 1u << (action_buttons[__builtin_ctz(held)] - BTN_LEFT);
+	}
+	uint32_t keyboards = 0;
+	for(int i = 0; i < MAX_KEYBOARDS; i++) {
+		keyboards += k->devices[i].fd >= 0;
+	}
+	bool changed = s->mode != mode || s->tier != tier || s->speed != speed || s->layer != (uint32_t) m->layer
+		|| s->buttons != buttons || s->keyboards != keyboards;
+
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&s->mode, mode, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->tier, tier, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->speed, speed, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->layer, m->layer, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->buttons, buttons, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->keyboards, keyboards, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->events, stats.events, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->frames, stats.frames, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->wakeups, stats.wakeups, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->grab_start_ns, stats.grab_start, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->grabbed_ns, stats.grabbed_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+
+	if(!changed) {
+		return;
+	}
+	uint64_t one = 1;
+	for(int i = 0; i < MAX_CLIENTS; i++) {
+		if(c->clients[i].notify_fd >= 0 && write(c->clients[i].notify_fd, &one, sizeof(one)) < 0) {
+			perror("Failed to signal a state change");
+		}
+	}
+}
+
+// CONTROL_SOCKET, or $XDG_RUNTIME_DIR/mouse_move.sock, "" when there is neither
+static void control_socket_path(char* buff, size_t size) {
+	const char* runtime = getenv("XDG_RUNTIME_DIR");
+	buff[0] = '\0';
+	if(CONTROL_SOCKET[0] != '\0') {
+		snprintf(buff, size, "%s", CONTROL_SOCKET);
+	}
+	else if(runtime != NULL && runtime[0] != '\0') {
+		snprintf(buff, size, "%s/mouse_move.sock", runtime);
+	}
+}
+
+/*
+ * Listen on the control socket. Nothing but accept() wakes the loop for
+ * it, so without clients it costs nothing. A socket left behind by a
+ * previous run is replaced, one another instance still listens on and
+ * anything else at the path are left alone.
+ */
+static int open_control_socket(Control* c) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct stat st;
+
+	for(int i = 0; i < MAX_CLIENTS; i++) {
+		c->clients[i].fd = -1;
+		c->clients[i].notify_fd = -1;
+	}
+	c->fd = -1;
+	control_socket_path(c->path, sizeof(c->path));
+	if(c->path[0] == '\0') {
+		return -1;
+	}
+	strcpy(addr.sun_path, c->path);
+	// only a stale socket, one nobody listens on, is ours to replace
+	if(lstat(c->path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(probe < 0) {
+			perror("Failed to create control socket");
+			return -1;
+		}
+		bool listening = connect(probe, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+		int connect_errno = errno;
+		close(probe);
+		if(listening) {
+			fprintf(stderr, "Another instance is listening on %s, running without a control socket\n", c->path);
+			return -1;
+		}
+		if(connect_errno == ECONNREFUSED) {
+			unlink(c->path);
+		}
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) {
+		perror("Failed to create control socket");
+		return -1;
+	}
+	// only the user running us may connect
+	mode_t mask = umask(0077);
+	int err = bind(fd, (struct sockaddr*) &addr, sizeof(addr));
+	umask(mask);
+	if(err < 0 || listen(fd, MAX_CLIENTS) < 0) {
+		perror(c->path);
+		close(fd);
+		return -1;
+	}
+	c->fd = fd;
+	return fd;
+}
+
+static void close_control_socket(Control* c) {
+	for(int i = 0; i < MAX_CLIENTS; i++) {
+		if(c->clients[i].fd >= 0) {
+			close(c->clients[i].fd);
+		}
+		if(c->clients[i].notify_fd >= 0) {
+			close(c->clients[i].notify_fd);
+		}
+	}
+	if(c->fd >= 0) {
+		close(c->fd);
+		unlink(c->path);
+	}
+}
+
+static void accept_clients(Control* c, int epoll_fd) {
+	int fd;
+	while((fd = accept4(c->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		Client* client = NULL;
+		for(int i = 0; i < MAX_CLIENTS && client == NULL; i++) {
+			if(c->clients[i].fd < 0) {
+				client = &c->clients[i];
+			}
+		}
+		if(client == NULL || watch_fd(epoll_fd, fd, SOURCE_CLIENT + (client - c->clients)) < 0) {
+			close(fd);
+			continue;
+		}
+		client->fd = fd;
+		client->in_len = 0;
+		client->out_len = 0;
+		client->overflow = false;
+		client->want_write = false;
+		client->fds_at = -1;
+	}
+}
+
+// queue a reply line, a client that doesn't read its replies is dropped rather than waited for
+static void client_printf(Client* client, const char* format, ...) {
+	size_t space = sizeof(client->out) - client->out_len;
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(client->out + client->out_len, space, format, args);
+	va_end(args);
+	if(len < 0 || (size_t) len >= space) {
+		client->overflow = true;
+		return;
+	}
+	client->out_len += len;
+}
+
+static void close_client(Client* client) {
+	close(client->fd); // also drops it from epoll
+	client->fd = -1;
+	if(client->notify_fd >= 0) {
+		close(client->notify_fd);
+		client->notify_fd = -1;
+	}
+}
+
+// send with the state block and the client's eventfd attached to the first byte
+static ssize_t send_state_fds(Client* client, size_t len) {
+	int fds[2] = { shared_state.fd, client->notify_fd };
+	union {
+		char buff[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {
+		.iov_base = client->out,
+		.iov_len = len,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buff,
+		.msg_controllen = sizeof(control.buff),
+	};
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	return sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+// write what the socket takes now, the rest waits for EPOLLOUT
+static void flush_client(Client* client, int epoll_fd, uint32_t source) {
+	if(client->overflow) {
+		close_client(client);
+		return;
+	}
+	while(client->out_len > 0) {
+		// the fds go with the first byte of their reply, so that starts a send of its own
+		ssize_t n;
+		if(client->fds_at == 0) {
+			n = send_state_fds(client, client->out_len);
+		}
+		else {
+			size_t len = client->fds_at > 0 ? (size_t) client->fds_at : client->out_len;
+			n = send(client->fd, client->out, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		}
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			close_client(client);
+			return;
+		}
+		if(client->fds_at >= 0) {
+			client->fds_at = client->fds_at == 0 ? -1 : client->fds_at - n;
+		}
+		memmove(client->out, client->out + n, client->out_len - n);
+		client->out_len -= n;
+	}
+	bool want_write = client->out_len > 0;
+	if(want_write != client->want_write) {
+		struct epoll_event ev = {
+			.events = EPOLLIN | (want_write ? EPOLLOUT : 0),
+			.data.u32 = source,
+		};
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+		client->want_write = want_write;
+	}
+}
+
+static void client_print_stats(Client* client) {
+	char line[2048];
+	FILE* f = fmemopen(line, sizeof(line), "w");
+	if(f == NULL) {
+		client_printf(client, "error %s\n", strerror(errno));
+		return;
+	}
+	print_stats(f);
+	fclose(f);
+	client_printf(client, "%s", line);
+}
+
+/*
+ * Apply one config file line to the running config, e.g. "speed_normal
+ * 1200" or "bind KEY_X up". It is parsed into a copy, so a bad line
+ * changes nothing. The next reload of the config file replaces it.
+ */
+static int set_config_line(Mouse* m, char* line) {
+	Config c = *config;
+	if(parse_config_line(&c, line) != 0) {
+		return -1;
+	}
+	// a "set layer N" must not redirect the binds of later set commands
+	c.bind_layer = 0;
+	build_accel_lut(&c);
+	build_bound_keys(&c);
+	int old_width = config->screen_width;
+	int old_height = config->screen_height;
+	*config = c;
+	resize_screen(m, old_width, old_height);
+	rebuild_actions(m);
+	return 0;
+}
+
+/*
+ * Commands, one per line, each answered with one line:
+ *   grab | ungrab | toggle   enter or leave mouse mode
+ *   tier slower|slow|normal|fast   speed tier while no modifier is held
+ *   set <config line>        change the running config, e.g. set speed_normal 1200
+ *   state                    mode, tier, speeds, keyboards, pointer position
+ *   stats                    the SIGUSR1 stats line
+ *   state_fd                 "ok" with the state block and an eventfd, see mouse_move_state.h
+ *   quit                     exit the daemon
+ */
+static void run_command(Client* client, char* line, Keyboards* k, Mouse* m, Mode* mode, bool* quit) {
+	const char* cmd = line;
+	char* arg = line + strcspn(line, " \t");
+	if(*arg != '\0') {
+		*arg++ = '\0';
+		arg += strspn(arg, " \t");
+	}
+
+	if(strcmp(cmd, "toggle") == 0) {
+		cmd = *mode == MODE_IDLE ? "grab" : "ungrab";
+	}
+	if(strcmp(cmd, "grab") == 0) {
+		// through the pending grab, the keys that ran this command may still be down
+		if(*mode == MODE_IDLE) {
+			begin_pending_grab(k, m, mode);
+			try_pending_grab(k, m, mode, now_ns());
+		}
+		client_printf(client, "ok %s\n", mode_names[*mode]);
+	}
+	else if(strcmp(cmd, "ungrab") == 0) {
+		if(*mode == MODE_GRABBING) {
+			end_mouse_mode(k, m, mode);
+		}
+		*mode = MODE_IDLE;
+		client_printf(client, "ok %s\n", mode_names[*mode]);
+	}
+	else if(strcmp(cmd, "tier") == 0) {
+		int tier = -1;
+		for(int t = 0; t < TIER_COUNT; t++) {
+			if(strcmp(arg, tier_names[t]) == 0) {
+				tier = t;
+			}
+		}
+		if(tier < 0) {
+			client_printf(client, "error unknown tier\n");
+			return;
+		}
+		m->base_tier = tier;
+		client_printf(client, "ok\n");
+	}
+	else if(strcmp(cmd, "set") == 0) {
+		if(set_config_line(m, arg) != 0) {
+			client_printf(client, "error invalid config line\n");
+			return;
+		}
+		client_printf(client, "ok\n");
+	}
+	else if(strcmp(cmd, "state") == 0) {
+		int keyboards = 0;
+		for(int i = 0; i < MAX_KEYBOARDS; i++) {
+			keyboards += k->devices[i].fd >= 0;
+		}
+		Tier tier = speed_tier(m);
+		client_printf(client, "mode=%s tier=%s speed=%d scroll_speed=%d layer=%d grid=%d x=%d y=%d keyboards=%d\n",
+			mode_names[*mode], tier_names[tier], config->motion_speeds[tier], config->scroll_speeds[tier],
+			m->layer, m->grid_active, m->pos_x, m->pos_y, keyboards);
+	}
+	else if(strcmp(cmd, "stats") == 0) {
+		client_print_stats(client);
+	}
+	else if(strcmp(cmd, "state_fd") == 0) {
+		if(shared_state.fd < 0) {
+			client_printf(client, "error no state block\n");
+			return;
+		}
+		if(client->notify_fd < 0) {
+			client->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if(client->notify_fd < 0) {
+				client_printf(client, "error %s\n", strerror(errno));
+				return;
+			}
+		}
+		// one set of fds per reply in flight is enough
+		if(client->fds_at < 0) {
+			client->fds_at = client->out_len;
+		}
+		client_printf(client, "ok\n");
+	}
+	else if(strcmp(cmd, "quit") == 0) {
+		if(*mode == MODE_GRABBING) {
+			end_mouse_mode(k, m, mode);
+		}
+		*quit = true;
+		client_printf(client, "ok\n");
+	}
+	else {
+		client_printf(client, "error unknown command\n");
+	}
+}
+
+static void handle_client(Control* c, uint32_t source, uint32_t events, int epoll_fd, Keyboards* k, Mouse* m, Mode* mode, bool* quit) {
+	Client* client = &c->clients[source - SOURCE_CLIENT];
+	if(client->fd < 0) {
+		return;
+	}
+	if(events & EPOLLIN) {
+		ssize_t n;
+		while((n = read(client->fd, client->in + client->in_len, sizeof(client->in) - client->in_len)) > 0) {
+			client->in_len += n;
+			char* line = client->in;
+			char* end;
+			while((end = memchr(line, '\n', client->in + client->in_len - line)) != NULL) {
+				*end = '\0';
+				if(end > line && end[-1] == '\r') {
+					end[-1] = '\0';
+				}
+				run_command(client, line, k, m, mode, quit);
+				line = end + 1;
+			}
+			client->in_len -= line - client->in;
+			memmove(client->in, line, client->in_len);
+			if(client->in_len == sizeof(client->in)) {
+				// no newline in a whole buffer
+				client->overflow = true;
+				break;
+			}
+		}
+		if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			close_client(client);
+			return;
+		}
+	}
+	else if(events & (EPOLLHUP | EPOLLERR)) {
+		close_client(client);
+		return;
+	}
+	flush_client(client, epoll_fd, source);
+}
+
+#ifdef MOUSE_MOVE_IO_URING
+/*
+ * The io_uring version of epoll_wait: submit what was queued (reads to
+ * re-arm, uinput frames) and wait in the same syscall, until a completion
+ * or the tick deadline. Keyboard reads are handled here, returns whether
+ * any other source is ready on epoll_fd.
+ */
+static bool uring_wait(Ring* r, uint64_t deadline, Keyboards* k, Mouse* m, Mode* mode, bool* quit) {
+	uint64_t timeout = 0;
+	if(deadline != 0) {
+		uint64_t now = now_ns();
+		timeout = deadline > now ? deadline - now : 1;
+	}
+	int ret = uring_enter(r, true, timeout);
+	if(ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+		perror("io_uring_enter failed");
+		*quit = true;
+		return false;
+	}
+
+	bool epoll_ready = false;
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	for(; head != tail && !(*quit); head++) {
+		struct io_uring_cqe cqe = r->cqes[head & r->cq_mask];
+		unsigned kind = cqe.user_data >> 56;
+		uint32_t gen = (cqe.user_data >> 32) & 0xffffff;
+		uint32_t index = cqe.user_data & 0xffffffff;
+
+		bool current = gen == (r->read_gen[index % MAX_KEYBOARDS] & 0xffffff);
+
+		if(kind == URING_EPOLL) {
+			if(cqe.res < 0) {
+				fprintf(stderr, "Polling epoll through io_uring failed: %s\n", strerror(-cqe.res));
+				*quit = true;
+				break;
+			}
+			epoll_ready = true;
+			// the kernel may end a multishot poll, e.g. when its CQ ran over
+			if(!(cqe.flags & IORING_CQE_F_MORE)) {
+				uring_poll_epoll(r, index);
+			}
+		}
+		else if(kind == URING_WRITE) {
+			r->write_busy[index] = false;
+			if(cqe.res < 0) {
+				fprintf(stderr, "Error writing to uinput: %s\n", strerror(-cqe.res));
+			}
+		}
+		else if((kind == URING_READ || (kind == URING_POLL && cqe.res < 0)) && current && k->devices[index].fd >= 0) {
+			Keyboard* d = &k->devices[index];
+			if(kind == URING_READ && cqe.res > 0) {
+				size_t n = (size_t) cqe.res / sizeof(struct input_event);
+				stats.reads++;
+				stats.events += n;
+				if(record_file != NULL) {
+					record_events(r->read_buffers[index], n);
+				}
+				process_events(r->read_buffers[index], n, d, k, m, mode, quit);
+			}
+			if(kind == URING_READ && (cqe.res > 0 || cqe.res == -EAGAIN)) {
+				uring_read(r, d->fd, index);
+			}
+			else {
+				if(cqe.res != -ENODEV) {
+					fprintf(stderr, "Error reading %s: %s\n", d->path, strerror(cqe.res < 0 ? -cqe.res : EIO));
+				}
+				lose_keyboard(k, d, m, mode);
+			}
+		}
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return epoll_ready;
+}
+#endif
+
+#ifdef MOUSE_MOVE_THREADS
+/*
+ * Take what the input thread read, one read(2) of one keyboard at a time,
+ * through the same processing as read_events.
+ */
+static void input_thread_drain(InputThread* t, Keyboards* k, Mouse* m, Mode* mode, bool* quit) {
+	struct input_event events[EVENT_BUFFER_SIZE];
+	size_t n = 0;
+	Keyboard* d = NULL;
+	Transition tr;
+	uint64_t count;
+
+	stats.syscalls++;
+	if(read(t->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		perror("Error reading the input thread eventfd");
+	}
+	while(!(*quit)) {
+		bool more = transition_pop(t, &tr);
+		if(n > 0 && (!more || tr.first || n == EVENT_BUFFER_SIZE)) {
+			if(record_file != NULL) {
+				record_events(events, n);
+			}
+			process_events(events, n, d, k, m, mode, quit);
+			n = 0;
+		}
+		if(!more) {
+			break;
+		}
+		d = &k->devices[tr.slot];
+		if(d->fd < 0 || tr.gen != (t->gen[tr.slot] & 0xffffff)) {
+			continue;
+		}
+		if(tr.type == TRANSITION_ERROR) {
+			if(tr.value != ENODEV) {
+				fprintf(stderr, "Error reading %s: %s\n", d->path, strerror(tr.value));
+			}
+			lose_keyboard(k, d, m, mode);
+			continue;
+		}
+		if(tr.first) {
+			stats.reads++;
+		}
+		stats.events++;
+		events[n++] = (struct input_event) {
+			.input_event_sec = tr.time_ns / 1000000000ULL,
+			.input_event_usec = tr.time_ns % 1000000000ULL / 1000,
+			.type = tr.type,
+			.code = tr.code,
+			.value = tr.value,
+		};
+	}
+	// a reader asleep on a full ring has room now
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_exchange_n(&t->full, false, __ATOMIC_RELAXED)) {
+		input_thread_kick(t);
+	}
+	if(__atomic_load_n(&t->exited, __ATOMIC_ACQUIRE)) {
+		// with a keyboard grabbed, nothing else would get its keys
+		fprintf(stderr, "Input thread stopped, exiting\n");
+		*quit = true;
+	}
+}
+#endif
+
+static void run_event_loop(Keyboards* keyboards, Mouse* mouse) {
+	bool quit = false;
+	Mode mode = MODE_IDLE;
+
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(epoll_fd < 0) {
+		perror("Failed to create epoll instance");
+		return;
+	}
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(timer_fd < 0) {
+		perror("Failed to create timer");
+		close(epoll_fd);
+		return;
+	}
+	int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(inotify_fd < 0 || inotify_add_watch(inotify_fd, INPUT_DIR, IN_CREATE | IN_ATTRIB | IN_DELETE) < 0) {
+		perror("Failed to watch " INPUT_DIR ", hotplug disabled");
+	}
+
+	// SIGUSR1 is blocked in main and read here, it prints the stats
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if(signal_fd < 0) {
+		perror("Failed to create signalfd");
+	}
+	else {
+		watch_fd(epoll_fd, signal_fd, SOURCE_SIGNAL);
+	}
+
+	// the periodic stats file is opt-in, without it nothing wakes us up
+	int stats_timer_fd = -1;
+	if(STATS_FILE[0] != '\0') {
+		struct itimerspec its = {
+			.it_interval.tv_sec = STATS_INTERVAL_S,
+			.it_value.tv_sec = STATS_INTERVAL_S,
+		};
+		stats_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if(stats_timer_fd < 0 || timerfd_settime(stats_timer_fd, 0, &its, NULL) < 0) {
+			perror("Failed to create stats timer");
+		}
+		else {
+			watch_fd(epoll_fd, stats_timer_fd, SOURCE_STATS_TIMER);
+		}
+	}
+
+	int config_fd = watch_config();
+	if(config_fd >= 0) {
+		watch_fd(epoll_fd, config_fd, SOURCE_CONFIG);
+	}
+
+	Control control;
+	if(open_control_socket(&control) >= 0) {
+		watch_fd(epoll_fd, control.fd, SOURCE_CONTROL);
+	}
+	create_shared_state();
+
+	// ticks only while a keyboard is lost, see handle_reconnect
+	int reconnect_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(reconnect_fd < 0) {
+		perror("Failed to create reconnect timer");
+	}
+	else {
+		watch_fd(epoll_fd, reconnect_fd, SOURCE_RECONNECT);
+	}
+	bool reconnect_armed = false;
+
+	watch_fd(epoll_fd, timer_fd, SOURCE_TIMER);
+	if(inotify_fd >= 0) {
+		watch_fd(epoll_fd, inotify_fd, SOURCE_HOTPLUG);
+	}
+
+	// timerfd wakeups may otherwise run up to 50 us late, 5% of a 1000 Hz motion period
+	if(prctl(PR_SET_TIMERSLACK, 1000UL, 0, 0, 0) < 0) {
+		perror("Failed to set timer slack");
+	}
+	// before the input thread starts, it inherits the policy, CPU and slack
+	setup_realtime();
+
+#ifdef MOUSE_MOVE_IO_URING
+	uring = uring_create();
+	if(uring == NULL) {
+		perror("io_uring unavailable, using epoll");
+	}
+	else {
+		uring_poll_epoll(uring, epoll_fd);
+	}
+#endif
+#ifdef MOUSE_MOVE_THREADS
+	input_thread = input_thread_start();
+	if(input_thread == NULL) {
+		perror("Failed to start the input thread, reading keyboards here");
+	}
+	else if(watch_fd(epoll_fd, input_thread->wake_fd, SOURCE_INPUT) < 0) {
+		input_thread_stop(input_thread);
+		input_thread = NULL;
+	}
+#endif
+	for(int i = 0; i < MAX_KEYBOARDS; i++) {
+		if(keyboards->devices[i].fd >= 0 && watch_keyboard(epoll_fd, keyboards, i) < 0) {
+			remove_keyboard(keyboards, &keyboards->devices[i], mouse);
+		}
+	}
+	uint64_t armed_deadline = 0;
+
+	struct epoll_event events[SOURCE_COUNT];
+	int n_events;
+	uint64_t expirations;
+	struct signalfd_siginfo siginfo;
+
+	stats.start = now_ns();
+	while(!quit) {
+		stats.wakeups++;
+#ifdef MOUSE_MOVE_IO_URING
+		if(uring != NULL) {
+			// keyboards and ticks come through the ring, epoll only has the rest
+			if(!uring_wait(uring, armed_deadline, keyboards, mouse, &mode, &quit)) {
+				n_events = 0;
+			}
+			else {
+				stats.syscalls++;
+				n_events = epoll_wait(epoll_fd, events, SOURCE_COUNT, 0);
+			}
+		}
+		else
+#endif
+		{
+			// no timeout: sleep until a key event, a hotplug or the next armed deadline
+			stats.syscalls++;
+			n_events = epoll_wait(epoll_fd, events, SOURCE_COUNT, -1);
+		}
+		if(n_events < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait failed");
+			quit = true;
+			break;
+		}
+		for(int i = 0; i < n_events && !quit; i++) {
+			uint32_t source = events[i].data.u32;
+			if(source == SOURCE_TIMER) {
+				// drain expirations, the deadlines themselves live in mouse
+				stats.syscalls++;
+				if(read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+					perror("Error reading timer");
+				}
+			}
+			else if(source == SOURCE_HOTPLUG) {
+				handle_hotplug(inotify_fd, epoll_fd, keyboards, mouse, &mode);
+			}
+			else if(source == SOURCE_SIGNAL) {
+				while(read(signal_fd, &siginfo, sizeof(siginfo)) == sizeof(siginfo)) {
+					print_stats(stderr);
+				}
+			}
+			else if(source == SOURCE_CONFIG) {
+				handle_config_change(config_fd, mouse);
+			}
+			else if(source == SOURCE_STATS_TIMER) {
+				if(read(stats_timer_fd, &expirations, sizeof(expirations)) > 0) {
+					append_stats_file();
+				}
+			}
+			else if(source == SOURCE_CONTROL) {
+				accept_clients(&control, epoll_fd);
+			}
+			else if(source == SOURCE_RECONNECT) {
+				if(read(reconnect_fd, &expirations, sizeof(expirations)) > 0) {
+					handle_reconnect(epoll_fd, keyboards, mouse, mode);
+				}
+			}
+			else if(source >= SOURCE_CLIENT) {
+				handle_client(&control, source, events[i].events, epoll_fd, keyboards, mouse, &mode, &quit);
+			}
+#ifdef MOUSE_MOVE_THREADS
+			else if(source == SOURCE_INPUT) {
+				input_thread_drain(input_thread, keyboards, mouse, &mode, &quit);
+			}
+#endif
+			else if(keyboards->devices[source].fd >= 0) {
+				Keyboard* d = &keyboards->devices[source];
+				int err = read_events(d, keyboards, mouse, &mode, &quit);
+				if(err != 0) {
+					// ENODEV when unplugged or revoked, inotify may not have told us yet
+					if(err != ENODEV) {
+						fprintf(stderr, "Error reading %s: %s\n", d->path, strerror(err));
+					}
+					lose_keyboard(keyboards, d, mouse, &mode);
+				}
+			}
+		}
+
+		bool reconnecting = keyboards->lost_count > 0;
+		if(reconnect_fd >= 0 && reconnecting != reconnect_armed) {
+			struct itimerspec its = { 0 };
+			if(reconnecting) {
+				its.it_value.tv_nsec = RECONNECT_POLL_MS * 1000000L;
+				its.it_interval = its.it_value;
+			}
+			if(timerfd_settime(reconnect_fd, 0, &its, NULL) == 0) {
+				reconnect_armed = reconnecting;
+			}
+		}
+
+		update_event_masks(keyboards, mouse, mode);
+
+		uint64_t deadline = 0;
+		if(mode == MODE_GRABBING) {
+			handle_mouse(mouse, now_ns());
+			deadline = next_deadline(mouse);
+		}
+		publish_state(keyboards, mouse, mode, &control);
+#ifdef MOUSE_MOVE_IO_URING
+		// the ring waits with the deadline as its timeout, no timer to arm
+		if(uring != NULL) {
+			armed_deadline = deadline;
+			continue;
+		}
+#endif
+		if(deadline != armed_deadline && arm_timer(timer_fd, deadline) == 0) {
+			armed_deadline = deadline;
+		}
+	}
+	if(inotify_fd >= 0) {
+		close(inotify_fd);
+	}
+	if(signal_fd >= 0) {
+		close(signal_fd);
+	}
+	if(config_fd >= 0) {
+		close(config_fd);
+	}
+	close_control_socket(&control);
+	destroy_shared_state();
+#ifdef MOUSE_MOVE_IO_URING
+	if(uring != NULL) {
+		uring_destroy(uring);
+		uring = NULL;
+	}
+#endif
+#ifdef MOUSE_MOVE_THREADS
+	if(input_thread != NULL) {
+		input_thread_stop(input_thread);
+		input_thread = NULL;
+	}
+#endif
+	if(reconnect_fd >= 0) {
+		close(reconnect_fd);
+	}
+	if(stats_timer_fd >= 0) {
+		close(stats_timer_fd);
+	}
+	close(timer_fd);
+	close(epoll_fd);
+	print_stats(stderr);
+}
+
+
+static void usage(const char* name) {
+	fprintf(stderr, "usage: %s [-c file] [-d device] [-r file]\n", name);
+	fprintf(stderr, "  -c file    config file, reloaded when it changes\n");
+	fprintf(stderr, "  -d device  use only this keyboard, overrides KEYBOARD_DEVICE\n");
+	fprintf(stderr, "  -r file    record the raw keyboard event stream to file\n");
+}
+
+int main(int argc, char** argv) {
+	int mouse_uifd;
+	Keyboards keyboards;
+	Mouse mouse;
+	uint64_t start = now_ns();
+	const char* record_path = NULL;
+	int opt;
+
+	default_config_path(config_path, sizeof(config_path));
+	while((opt = getopt(argc, argv, "c:d:r:h")) != -1) {
+		switch(opt) {
+		case 'c':
+			snprintf(config_path, sizeof(config_path), "%s", optarg);
+			break;
+		case 'd':
+			keyboard_device = optarg;
+			break;
+		case 'r':
+			record_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	// must be blocked before anything can send it, the loop reads it from a signalfd
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &signals, NULL);
+
+	if(record_path != NULL) {
+		record_file = fopen(record_path, "we");
+		if(record_file == NULL || fwrite(RECORD_MAGIC, 8, 1, record_file) != 1) {
+			perror("Failed to open record file");
+			return 1;
+		}
+	}
+	
+	config = load_config(config_path);
+	if(config == NULL) {
+		return 1;
+	}
+
+	if(init_keyboards(&keyboards) != 0){
+		return 1;
+	}
+
+	mouse_uifd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+	if(mouse_uifd < 0) {
+		perror("Failed to open /dev/uinput. Is the uinput module loaded?");
+		destroy_keyboards(&keyboards);
+		return 1;
 	}
 	if(init_mouse(&mouse, mouse_uifd) != 0) {
 		close(mouse_uifd);
-		close(keyboard_fd);
+		destroy_keyboards(&keyboards);
 		return 1;
 	}
+	fprintf(stderr, "Ready in %.2f ms\n", (now_ns() - start) / 1e6);
 
-	run_event_loop(keyboard_fd, &mouse);
+	run_event_loop(&keyboards, &mouse);
 	
 	destroy_mouse(&mouse);
 	close(mouse_uifd);
-	close(keyboard_fd);
+	destroy_keyboards(&keyboards);
+	if(record_file != NULL) {
+		fclose(record_file);
+	}
+	free(config);
 	return 0;
 }
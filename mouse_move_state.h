@@ -0,0 +1,74 @@
+/*
+ * mouse_move_state.h — the state block mouse_move shares with status bars
+ * and overlays
+ *
+ * Send "state_fd" on the control socket. The "ok" reply line carries two
+ * file descriptors (SCM_RIGHTS): a memfd holding one struct
+ * mouse_move_state, to mmap with PROT_READ and MAP_SHARED, and a
+ * non-blocking eventfd that becomes readable whenever mode, tier, speed,
+ * layer, buttons or the keyboard count change. The eventfd belongs to the
+ * connection it was sent on, keep that open while you watch it.
+ *
+ * Reading the block takes no syscall, the daemon updates it in place:
+ *
+ *     struct mouse_move_state s;
+ *     mouse_move_state_read(block, &s);
+ *     if(s.mode == MOUSE_MOVE_MODE_GRABBING) ...
+ */
+
+#ifndef MOUSE_MOVE_STATE_H
+#define MOUSE_MOVE_STATE_H
+
+#include <stdint.h>
+
+#define MOUSE_MOVE_STATE_VERSION 1
+
+#define MOUSE_MOVE_MODE_IDLE 0
+#define MOUSE_MOVE_MODE_PENDING 1 // start combo seen, waiting for its keys to go up
+#define MOUSE_MOVE_MODE_GRABBING 2
+
+struct mouse_move_state {
+	uint32_t seq; // odd while the daemon writes, see mouse_move_state_read
+	uint32_t version; // MOUSE_MOVE_STATE_VERSION
+	uint32_t mode; // MOUSE_MOVE_MODE_*
+	uint32_t tier; // speed tier: 0 slower, 1 slow, 2 normal, 3 fast
+	uint32_t speed; // px/s at that tier
+	uint32_t layer; // keymap layer, 0 is the base layer
+	uint32_t buttons; // held on the virtual mouse, bit n is BTN_LEFT + n
+	uint32_t keyboards; // in use
+	// counters, they change without a wakeup on the eventfd
+	uint64_t events; // keyboard events read
+	uint64_t frames; // reports written to uinput
+	uint64_t wakeups; // event loop iterations
+	uint64_t grab_start_ns; // CLOCK_MONOTONIC start of the current grab, 0 while not grabbing
+	uint64_t grabbed_ns; // time grabbed before the current grab
+};
+
+/*
+ * Seqlock read: copy the block, and copy again if the daemon wrote to it
+ * in the meantime. The daemon never waits for readers.
+ */
+static inline void mouse_move_state_read(const struct mouse_move_state* block, struct mouse_move_state* out) {
+	uint32_t seq;
+	do {
+		// a write is a few stores, not worth sleeping for
+		while((seq = __atomic_load_n(&block->seq, __ATOMIC_ACQUIRE)) & 1) {
+		}
+		out->version = __atomic_load_n(&block->version, __ATOMIC_RELAXED);
+		out->mode = __atomic_load_n(&block->mode, __ATOMIC_RELAXED);
+		out->tier = __atomic_load_n(&block->tier, __ATOMIC_RELAXED);
+		out->speed = __atomic_load_n(&block->speed, __ATOMIC_RELAXED);
+		out->layer = __atomic_load_n(&block->layer, __ATOMIC_RELAXED);
+		out->buttons = __atomic_load_n(&block->buttons, __ATOMIC_RELAXED);
+		out->keyboards = __atomic_load_n(&block->keyboards, __ATOMIC_RELAXED);
+		out->events = __atomic_load_n(&block->events, __ATOMIC_RELAXED);
+		out->frames = __atomic_load_n(&block->frames, __ATOMIC_RELAXED);
+		out->wakeups = __atomic_load_n(&block->wakeups, __ATOMIC_RELAXED);
+		out->grab_start_ns = __atomic_load_n(&block->grab_start_ns, __ATOMIC_RELAXED);
+		out->grabbed_ns = __atomic_load_n(&block->grabbed_ns, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while(__atomic_load_n(&block->seq, __ATOMIC_RELAXED) != seq);
+	out->seq = seq;
+}
+
+#endif /* MOUSE_MOVE_STATE_H */